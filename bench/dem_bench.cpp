@@ -0,0 +1,302 @@
+// microbenchmarks for dem's hot paths, built as the dem_bench target
+//
+// usage: dem_bench [--filter=<substr>] [--samples=<n>] [--json=<file>]
+// configure with -DCMAKE_BUILD_TYPE=Release, the default is a debug build
+//
+// every benchmark is calibrated to ~10ms per sample, run once to warm up and
+// then sampled, results are nanoseconds per operation summarized over the
+// samples. the devices come from the dem_core library dem links too
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dem.hpp"
+
+struct microbench_result_t {
+  std::string _name;
+  uint64_t    _iterations;  // operations per sample
+  double      _min;
+  double      _median;
+  double      _mean;
+  double      _stddev;
+  double      _p90;
+};
+
+struct bench_options_t {
+  std::string _filter;
+  std::string _json_path;
+  uint32_t    _samples = 21;
+};
+
+static bench_options_t                  bench_options;
+static std::vector<microbench_result_t> microbench_results;
+
+// keeps the compiler from dropping or hoisting benchmarked work
+inline void do_not_optimize(uint64_t value) {
+  asm volatile("" : : "r"(value) : "memory");
+}
+
+uint64_t bench_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// fn(iterations) performs iterations operations
+template <typename fn_t>
+void run_benchmark(const std::string &name, fn_t &&fn) {
+  if (!bench_options._filter.empty() &&
+      name.find(bench_options._filter) == std::string::npos)
+    return;
+  constexpr uint64_t target_ns  = 10'000'000;
+  uint64_t           iterations = 1;
+  while (true) {
+    uint64_t start   = bench_now_ns();
+    fn(iterations);
+    uint64_t elapsed = bench_now_ns() - start;
+    if (elapsed >= target_ns / 2 || iterations >= (1ull << 40)) {
+      if (elapsed)
+        iterations = std::max<uint64_t>(
+            1, std::min(double(iterations) * target_ns / elapsed, 0x1p40));
+      break;
+    }
+    iterations *= 2;
+  }
+  fn(iterations);  // warm up
+
+  std::vector<double> samples;
+  for (uint32_t i = 0; i < bench_options._samples; i++) {
+    uint64_t start = bench_now_ns();
+    fn(iterations);
+    samples.push_back(double(bench_now_ns() - start) / iterations);
+  }
+  std::sort(samples.begin(), samples.end());
+  double mean = 0;
+  for (double sample : samples) mean += sample;
+  mean /= samples.size();
+  double variance = 0;
+  for (double sample : samples) variance += (sample - mean) * (sample - mean);
+  variance /= std::max<size_t>(samples.size() - 1, 1);
+
+  microbench_result_t result{._name       = name,
+                             ._iterations = iterations,
+                             ._min        = samples.front(),
+                             ._median     = samples[samples.size() / 2],
+                             ._mean       = mean,
+                             ._stddev     = std::sqrt(variance),
+                             ._p90        = samples[samples.size() * 9 / 10]};
+  std::cout << std::format("{:<36} {:>10.2f} {:>10.2f} {:>10.2f} {:>8.2f}\n",
+                           name, result._min, result._median, result._p90,
+                           result._stddev);
+  microbench_results.push_back(result);
+}
+
+void write_bench_json(const std::string &path) {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open bench output: " + path);
+  file << "[\n";
+  for (uint64_t i = 0; i < microbench_results.size(); i++) {
+    const microbench_result_t &result = microbench_results[i];
+    file << std::format(
+        "  {{\"name\": \"{}\", \"iterations\": {}, \"samples\": {}, "
+        "\"min_ns\": {:.3f}, \"median_ns\": {:.3f}, \"mean_ns\": {:.3f}, "
+        "\"stddev_ns\": {:.3f}, \"p90_ns\": {:.3f}}}{}\n",
+        result._name, result._iterations, bench_options._samples, result._min,
+        result._median, result._mean, result._stddev, result._p90,
+        i + 1 < microbench_results.size() ? "," : "");
+  }
+  file << "]\n";
+}
+
+// j-type encoding of jal rd, offset
+uint32_t encode_jal(uint32_t rd, int32_t offset) {
+  uint32_t imm = static_cast<uint32_t>(offset);
+  return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) |
+         (((imm >> 11) & 1) << 20) | (((imm >> 12) & 0xff) << 12) | (rd << 7) |
+         0x6f;
+}
+
+constexpr uint32_t rv_addi_x1_x1_1 = 0x00108093;
+constexpr uint32_t rv_sd_x1_0_x2   = 0x00113023;
+constexpr uint32_t rv_ld_x3_0_x2   = 0x00013183;
+const uint64_t     bench_code_addr = offset;
+const uint64_t     bench_data_addr = offset + 0x100000;
+
+// writes body repeated to fill a 4KiB block that jumps back to its start
+void write_instruction_loop(const std::vector<uint32_t> &body) {
+  std::vector<uint32_t> code;
+  while (code.size() + body.size() < 1023)
+    code.insert(code.end(), body.begin(), body.end());
+  code.push_back(encode_jal(0, -4 * static_cast<int32_t>(code.size())));
+  machine->memcpy_host_to_guest(bench_code_addr, code.data(),
+                                code.size() * sizeof(uint32_t));
+}
+
+void bench_step(const std::string &name, const std::vector<uint32_t> &body) {
+  write_instruction_loop(body);
+  run_benchmark("step/" + name, [](uint64_t iterations) {
+    machine->_pc     = bench_code_addr;
+    machine->_reg[2] = bench_data_addr;
+    machine->step(iterations);
+  });
+}
+
+struct bench_mmio_access_t {
+  const char *_device;
+  uint64_t    _load_addr;
+  uint64_t    _store_addr;  // 0 when stores have side effects
+};
+
+void bench_mmio_dispatch() {
+  const bench_mmio_access_t accesses[] = {
+      {"uart", uart_mmio_start + 5, uart_mmio_start + 7},
+      {"clint", clint_mmio_start + 0xbff8, clint_mmio_start + 0x4000},
+      {"plic", plic_mmio_start + 4, plic_mmio_start + 4},
+      {"snapshot", snapshot_mmio_start + 8, 0},
+      {"framebuffer", framebuffer_mmio_start, framebuffer_mmio_start},
+  };
+  for (const bench_mmio_access_t &access : accesses) {
+    run_benchmark(std::string("mmio/load/") + access._device,
+                  [&](uint64_t iterations) {
+                    for (uint64_t i = 0; i < iterations; i++)
+                      do_not_optimize(
+                          mmio_dispatch_handler._load64(access._load_addr));
+                  });
+    if (!access._store_addr) continue;
+    run_benchmark(std::string("mmio/store/") + access._device,
+                  [&](uint64_t iterations) {
+                    for (uint64_t i = 0; i < iterations; i++)
+                      mmio_dispatch_handler._store64(access._store_addr, i);
+                  });
+  }
+}
+
+// claim, complete and re-raise one source with active sources pending,
+// followed by the meip recomputation the run loop does
+void bench_plic() {
+  for (uint32_t active : {1u, 8u, 64u, 512u}) {
+    plic = {};
+    for (uint32_t word = 0; word < 32; word++) plic._enable[word] = ~0u;
+    for (uint32_t id = 1; id <= active; id++) {
+      plic._priority[id] = 1 + id % 7;
+      plic_set_pending(id, true);
+    }
+    run_benchmark("plic/claim_complete/" + std::to_string(active),
+                  [](uint64_t iterations) {
+                    for (uint64_t i = 0; i < iterations; i++) {
+                      uint64_t id =
+                          plic_handler._load64(plic_mmio_start + 0x200004);
+                      plic_handler._store64(plic_mmio_start + 0x200004, id);
+                      plic_set_pending(id, true);
+                      if (plic._best)
+                        machine->_csr[dawn::MIP] |= (1ull << 11);
+                      else
+                        machine->_csr[dawn::MIP] &= ~(1ull << 11);
+                    }
+                  });
+  }
+  plic = {};
+}
+
+// stands in for uart_writer_thread, which is not running here
+void drain_uart_tx() {
+  uint64_t count;
+  do {
+    uart_tx.peek(count);
+    uart_tx.consume(count);
+  } while (count);
+}
+
+void bench_uart() {
+  run_benchmark("uart/load_lsr", [](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++)
+      do_not_optimize(uart_handler._load64(uart_mmio_start + 5));
+  });
+  run_benchmark("uart/load_rbr", [](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+      if (uart_rx.empty())
+        for (uint32_t c = 0; c < 64; c++) uart_rx.push('a');
+      do_not_optimize(uart_handler._load64(uart_mmio_start));
+    }
+  });
+  run_benchmark("uart/store_thr", [](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+      if (i % 4096 == 0) drain_uart_tx();
+      uart_handler._store64(uart_mmio_start, 'a');
+    }
+  });
+  drain_uart_tx();
+}
+
+void bench_framebuffer() {
+  for (int byte_order : {LSBFirst, MSBFirst}) {
+    std::vector<char> data(stride * height);
+    XImage            image{};
+    image.width          = width;
+    image.height         = height;
+    image.data           = data.data();
+    image.bytes_per_line = stride;
+    image.byte_order     = byte_order;
+    run_benchmark(std::string("framebuffer/convert_frame/") +
+                      (byte_order == LSBFirst ? "lsb" : "msb"),
+                  [&](uint64_t iterations) {
+                    for (uint64_t i = 0; i < iterations; i++)
+                      convert_framebuffer_rows(&image, 0, height);
+                  });
+  }
+}
+
+void bench_dtb() {
+  run_benchmark("dtb/generate", [](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++)
+      do_not_optimize(generate_dtb().size());
+  });
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.starts_with("--filter=")) {
+      bench_options._filter = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--samples=")) {
+      bench_options._samples = std::stoul(arg.substr(arg.find('=') + 1));
+      if (!bench_options._samples)
+        throw std::runtime_error("--samples must be greater than 0");
+    } else if (arg.starts_with("--json=")) {
+      bench_options._json_path = arg.substr(arg.find('=') + 1);
+    } else {
+      throw std::runtime_error(
+          "[dem_bench] [--filter=<substr>] [--samples=<n>] [--json=<file>]");
+    }
+  }
+
+  ram_size = 64 * 1024 * 1024;
+  register_mmio_device("uart", uart_handler);
+  register_mmio_device("clint", clint_handler);
+  register_mmio_device("plic", plic_handler);
+  register_mmio_device("snapshot", snapshot_handler);
+  register_mmio_device("framebuffer", framebuffer_handler);
+  machine = new dawn::machine_t(ram_size, offset, {mmio_dispatch_handler});
+
+  std::cout << std::format("{:<36} {:>10} {:>10} {:>10} {:>8}\n",
+                           "benchmark (ns/op)", "min", "median", "p90",
+                           "stddev");
+  bench_step("alu", {rv_addi_x1_x1_1});
+  bench_step("load_store", {rv_addi_x1_x1_1, rv_sd_x1_0_x2, rv_ld_x3_0_x2});
+  bench_mmio_dispatch();
+  bench_plic();
+  bench_uart();
+  bench_framebuffer();
+  bench_dtb();
+
+  if (!bench_options._json_path.empty())
+    write_bench_json(bench_options._json_path);
+  return 0;
+}
@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# usage: scripts/bench.sh [dem] [Image] [output.json]
+# packs rootfs into rootfs.cpio and runs the end to end guest benchmark
+
+DEM=${1:-_build/dem}
+IMAGE=${2:-Image}
+OUTPUT=${3:-bench.json}
+
+./scripts/pack.sh
+"$DEM" --bench="$OUTPUT" "$IMAGE" rootfs.cpio < /dev/null
@@ -0,0 +1,4945 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <chrono>
+#include <compare>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <string>
+using namespace std::string_literals;  // for ""s suffix
+
+#include <asm-generic/ioctls.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/input.h>
+#include <linux/openat2.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <termios.h>
+
+#include <elf.h>
+#include <zlib.h>
+#ifdef DEM_HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef DEM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <libfdt.h>
+#include <libfdt_env.h>
+
+#include <X11/Xlib.h>
+#include <X11/XKBlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "dem.hpp"
+
+dawn::machine_t *machine;
+
+// see back_guest_ram
+enum ram_backing_t : uint8_t {
+  ram_backing_thp,      // lazily committed, transparent huge pages
+  ram_backing_hugetlb,  // preallocated hugetlbfs pages
+  ram_backing_dawn,     // dawn's own allocation, left alone
+};
+
+struct options_t {
+  std::string _kernel_path;
+  std::string _initrd_path;
+  std::string _console_log_path;  // tee guest console output to this file
+  // when non zero mtime advances one tick every _icount retired instructions
+  // instead of following the host wall clock
+  uint64_t    _icount = 0;
+  std::string _snapshot_path;  // written on SIGUSR2 or a guest snapshot poke
+  std::string _restore_path;   // resume from this snapshot instead of booting
+  uint64_t    _ram_size = 1024 * 1024 * 1024;
+  std::string _bench_path;  // run the guest benchmark, write json results here
+  std::string _profile_path;  // guest pc profile report, written on exit
+  std::string _profile_symbols_path;  // System.map or vmlinux
+  uint64_t    _profile_hz = 1000;
+  bool        _fb_ram     = false;  // framebuffer lives in guest ram
+  std::string _disk_path;  // raw image served by virtio-blk
+  bool        _disk_read_only = false;
+  std::string _append;  // extra kernel command line
+  std::string _share_path;  // host directory served over virtio-9p
+  std::string _share_tag = "host0";
+  // what backs guest ram on the host
+  ram_backing_t _ram_backing = ram_backing_thp;
+  // fork this many copies of the booted or restored guest, sharing its ram
+  // copy on write, running at most _clone_jobs at a time
+  uint32_t    _clones     = 0;
+  uint32_t    _clone_jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  std::string _stats_path;  // json lines stats, a file or unix:<socket>
+  uint64_t    _stats_interval_ms = 1000;
+  bool        _headless          = false;  // no x11 window or input
+  std::string _capture_path;  // framebuffer frames, raw bgra or .y4m
+  uint32_t    _capture_fps = 30;
+  bool        _balloon     = false;  // virtio-balloon, free page reporting
+  std::string _shmem_path;  // host file shared with the guest
+  uint64_t    _shmem_size = 16 * 1024 * 1024;
+  // exit with status 124 once either budget is used up, 0 when unlimited
+  uint64_t    _max_instructions = 0;
+  uint64_t    _timeout_ms       = 0;
+  std::string _record_path;  // log of nondeterministic input to write
+  std::string _replay_path;  // log to take input from instead of the host
+};
+static options_t options;
+
+const std::string usage = "[dem] [options] [Image] [initrd]\n"
+                          "  --console-log=<file>  tee console output to file\n"
+                          "  --icount=<n>          deterministic clock, one "
+                          "mtime tick per n instructions\n"
+                          "  --snapshot=<file>     snapshot target for SIGUSR2 "
+                          "or a guest poke\n"
+                          "  --restore=<file>      resume from a snapshot, "
+                          "Image and initrd are not needed\n"
+                          "  --ram=<size>          guest ram, eg 512M or 2G "
+                          "(default 1G)\n"
+                          "  --ram-backing=<b>     thp (default), hugetlb "
+                          "pages reserved in /proc/sys/vm/nr_hugepages, or "
+                          "dawn to keep dawn's own allocation\n"
+                          "  --bench=<file>        boot, run the guest "
+                          "benchmark and write json results\n"
+                          "  --profile=<file>      sample the guest pc, write "
+                          "a flat report (folded if file ends in .folded)\n"
+                          "  --profile-symbols=<f> System.map or vmlinux used "
+                          "to symbolize the report\n"
+                          "  --profile-hz=<n>      samples per second of guest "
+                          "time (default 1000)\n"
+                          "  --fb-ram              place the framebuffer in "
+                          "guest ram instead of mmio, every frame then diffs "
+                          "the whole framebuffer to find changed rows\n"
+                          "  --disk=<file>[,ro]    raw disk image served over "
+                          "virtio-blk, initrd becomes optional\n"
+                          "  --append=<args>       append to the kernel "
+                          "command line, eg root=/dev/vda\n"
+                          "  --share=<dir>[,tag=<t>] share a host directory "
+                          "over virtio-9p (tag host0), initrd becomes "
+                          "optional\n"
+                          "  --clones=<n>          run n copy on write clones "
+                          "of the guest, output paths get a .<clone> suffix\n"
+                          "  --clone-jobs=<n>      clones running at once "
+                          "(default number of cpus)\n"
+                          "  --stats=<file>        write runtime stats as json "
+                          "lines, unix:<path> sends them to a socket\n"
+                          "  --stats-interval=<n>  milliseconds between stats "
+                          "lines (default 1000), SIGUSR1 writes one now\n"
+                          "  --headless            run without an x11 window "
+                          "or virtio-input\n"
+                          "  --capture=<file>      write changed frames as raw "
+                          "bgra, or y4m if file ends in .y4m\n"
+                          "  --capture-fps=<n>     frames per second of guest "
+                          "time to capture (default 30)\n"
+                          "  --shmem=<file>[,size=<n>] share a host file with "
+                          "the guest (default 16M), mapped into guest ram "
+                          "with thp ram backing, else mmio at 0x40000000\n"
+                          "  --balloon             return guest ram the guest "
+                          "reports free to the host, needs thp ram backing\n"
+                          "  --max-instructions=<n> stop after n retired "
+                          "instructions, exit status 124\n"
+                          "  --timeout=<seconds>   stop after this much wall "
+                          "time, exit status 124\n"
+                          "  --record=<file>       log host input, time and "
+                          "interrupts for --replay\n"
+                          "  --replay=<file>       run again from a --record "
+                          "log, same command line otherwise";
+
+// parses a byte count with an optional K, M or G suffix
+uint64_t parse_size(const std::string &str) {
+  size_t   idx;
+  uint64_t size = std::stoull(str, &idx);
+  if (idx == str.size()) return size;
+  if (idx + 1 != str.size())
+    throw std::runtime_error("invalid size " + str);
+  uint32_t shift = 0;
+  switch (std::toupper(str[idx])) {
+    case 'K': shift = 10; break;
+    case 'M': shift = 20; break;
+    case 'G': shift = 30; break;
+    default: throw std::runtime_error("invalid size " + str);
+  }
+  if (size > UINT64_MAX >> shift)
+    throw std::runtime_error("size out of range " + str);
+  return size << shift;
+}
+
+options_t parse_options(int argc, char **argv) {
+  options_t                options;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.starts_with("--console-log=")) {
+      options._console_log_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--icount=")) {
+      options._icount = std::stoull(arg.substr(arg.find('=') + 1));
+      if (!options._icount)
+        throw std::runtime_error("--icount must be greater than 0");
+    } else if (arg.starts_with("--snapshot=")) {
+      options._snapshot_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--restore=")) {
+      options._restore_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--ram=")) {
+      options._ram_size = parse_size(arg.substr(arg.find('=') + 1));
+      if (!options._ram_size || options._ram_size % (1024 * 1024))
+        throw std::runtime_error("--ram must be a non zero multiple of 1M");
+    } else if (arg.starts_with("--ram-backing=")) {
+      std::string backing = arg.substr(arg.find('=') + 1);
+      if (backing == "thp")
+        options._ram_backing = ram_backing_thp;
+      else if (backing == "hugetlb")
+        options._ram_backing = ram_backing_hugetlb;
+      else if (backing == "dawn")
+        options._ram_backing = ram_backing_dawn;
+      else
+        throw std::runtime_error("--ram-backing must be thp, hugetlb or dawn");
+    } else if (arg.starts_with("--bench=")) {
+      options._bench_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--profile=")) {
+      options._profile_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--profile-symbols=")) {
+      options._profile_symbols_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--profile-hz=")) {
+      options._profile_hz = std::stoull(arg.substr(arg.find('=') + 1));
+      if (!options._profile_hz)
+        throw std::runtime_error("--profile-hz must be greater than 0");
+    } else if (arg == "--fb-ram") {
+      options._fb_ram = true;
+    } else if (arg.starts_with("--disk=")) {
+      options._disk_path = arg.substr(arg.find('=') + 1);
+      if (options._disk_path.ends_with(",ro")) {
+        options._disk_path.resize(options._disk_path.size() - 3);
+        options._disk_read_only = true;
+      }
+    } else if (arg.starts_with("--share=")) {
+      options._share_path = arg.substr(arg.find('=') + 1);
+      auto tag            = options._share_path.find(",tag=");
+      if (tag != std::string::npos) {
+        options._share_tag = options._share_path.substr(tag + 5);
+        options._share_path.resize(tag);
+      }
+    } else if (arg.starts_with("--append=")) {
+      options._append = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--stats=")) {
+      options._stats_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--stats-interval=")) {
+      options._stats_interval_ms = std::stoull(arg.substr(arg.find('=') + 1));
+      if (!options._stats_interval_ms)
+        throw std::runtime_error("--stats-interval must be greater than 0");
+    } else if (arg == "--headless") {
+      options._headless = true;
+    } else if (arg.starts_with("--capture=")) {
+      options._capture_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--capture-fps=")) {
+      options._capture_fps = std::stoul(arg.substr(arg.find('=') + 1));
+      if (!options._capture_fps || options._capture_fps > 1000000)
+        throw std::runtime_error("--capture-fps must be between 1 and 1000000");
+    } else if (arg.starts_with("--max-instructions=")) {
+      options._max_instructions = std::stoull(arg.substr(arg.find('=') + 1));
+    } else if (arg.starts_with("--timeout=")) {
+      options._timeout_ms = std::stod(arg.substr(arg.find('=') + 1)) * 1000;
+    } else if (arg.starts_with("--record=")) {
+      options._record_path = arg.substr(arg.find('=') + 1);
+    } else if (arg.starts_with("--replay=")) {
+      options._replay_path = arg.substr(arg.find('=') + 1);
+    } else if (arg == "--balloon") {
+      options._balloon = true;
+    } else if (arg.starts_with("--shmem=")) {
+      options._shmem_path = arg.substr(arg.find('=') + 1);
+      auto size           = options._shmem_path.find(",size=");
+      if (size != std::string::npos) {
+        options._shmem_size = parse_size(options._shmem_path.substr(size + 6));
+        options._shmem_path.resize(size);
+      }
+    } else if (arg.starts_with("--clones=")) {
+      options._clones = std::stoul(arg.substr(arg.find('=') + 1));
+    } else if (arg.starts_with("--clone-jobs=")) {
+      options._clone_jobs = std::stoul(arg.substr(arg.find('=') + 1));
+      if (!options._clone_jobs)
+        throw std::runtime_error("--clone-jobs must be greater than 0");
+    } else if (arg.starts_with("--")) {
+      throw std::runtime_error("unknown option " + arg + "\n" + usage);
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (!options._record_path.empty() && !options._replay_path.empty())
+    throw std::runtime_error("--record and --replay exclude each other");
+  if ((!options._record_path.empty() || !options._replay_path.empty()) &&
+      (options._clones || !options._bench_path.empty()))
+    throw std::runtime_error(
+        "--record and --replay do not work with --clones or --bench");
+  // the log only holds what the guest reads from dem, a writable disk, a
+  // shared directory or shared memory would replay against changed contents
+  if ((!options._record_path.empty() || !options._replay_path.empty()) &&
+      ((!options._disk_path.empty() && !options._disk_read_only) ||
+       !options._share_path.empty() || !options._shmem_path.empty()))
+    throw std::runtime_error(
+        "--record and --replay need --disk=<file>,ro and do not work with "
+        "--share or --shmem");
+  if (options._balloon && options._ram_backing != ram_backing_thp)
+    throw std::runtime_error("--balloon needs --ram-backing=thp");
+  if (!options._restore_path.empty() && positional.empty()) return options;
+  // with a root disk or share the initrd is optional
+  if (positional.size() != 2 &&
+      (positional.size() != 1 ||
+       (options._disk_path.empty() && options._share_path.empty())))
+    throw std::runtime_error(usage);
+  options._kernel_path = positional[0];
+  if (positional.size() == 2) options._initrd_path = positional[1];
+  return options;
+}
+
+std::string to_hex_string(uint64_t val) { return std::format("{:#x}", val); }
+
+// read only view of a file, backed by the page cache instead of a heap copy
+struct mapped_file_t {
+  const uint8_t *_data = nullptr;
+  uint64_t       _size = 0;
+
+  mapped_file_t() = default;
+  mapped_file_t(const mapped_file_t &) = delete;
+  mapped_file_t(mapped_file_t &&other) { *this = std::move(other); }
+  mapped_file_t &operator=(mapped_file_t &&other) {
+    std::swap(_data, other._data);
+    std::swap(_size, other._size);
+    return *this;
+  }
+  ~mapped_file_t() {
+    if (_data) munmap(const_cast<uint8_t *>(_data), _size);
+  }
+  uint64_t       size() const { return _size; }
+  const uint8_t *data() const { return _data; }
+};
+
+mapped_file_t map_file(const std::string &file_path) {
+  int fd = open(file_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open file: " + file_path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    throw std::runtime_error("Failed to read file: " + file_path);
+  }
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Failed to map file: " + file_path);
+  }
+  // read ahead aggressively, the whole file is copied into the guest once
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  madvise(data, st.st_size, MADV_WILLNEED);
+  mapped_file_t file;
+  file._data = reinterpret_cast<const uint8_t *>(data);
+  file._size = st.st_size;
+  return file;
+}
+
+inline uint64_t get_time_now_us() {
+  auto      now_tp = std::chrono::system_clock::now();
+  long long microseconds_count =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          now_tp.time_since_epoch())
+          .count();
+  return microseconds_count;
+}
+
+// the run loop idles in epoll while the guest sits in wfi, woken by the
+// timerfd armed to the next timercmp or by the eventfd that host threads and
+// signal handlers poke when they hand the guest new work. stdin is owned by
+// uart_reader_thread, it pokes the eventfd after queueing input
+static int idle_epoll_fd = -1;
+static int idle_timer_fd = -1;
+static int idle_wake_fd  = -1;
+
+void init_idle() {
+  idle_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  idle_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  idle_wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (idle_epoll_fd < 0 || idle_timer_fd < 0 || idle_wake_fd < 0)
+    throw std::runtime_error("Failed to create idle fds");
+  for (int fd : {idle_timer_fd, idle_wake_fd}) {
+    epoll_event event{.events = EPOLLIN, .data = {.fd = fd}};
+    if (epoll_ctl(idle_epoll_fd, EPOLL_CTL_ADD, fd, &event))
+      throw std::runtime_error("Failed to add idle fd to epoll");
+  }
+}
+
+// async signal safe
+void idle_wake() {
+  uint64_t one = 1;
+  if (idle_wake_fd >= 0) (void)!write(idle_wake_fd, &one, sizeof(one));
+}
+
+// counters published by --stats, plain integers owned by the run loop thread
+// which also writes the stats lines, the present thread keeps its own atomics
+struct run_stats_t {
+  uint64_t _idle_us;           // blocked in idle_wait
+  uint64_t _idle_waits;
+  uint64_t _housekeeping_us;   // outer loop work, snapshots, reports, stats
+  uint64_t _timer_interrupts;  // mtip raised
+  uint64_t _plic_claims;       // external interrupts taken by the guest
+  uint64_t _balloon_freed;     // bytes of guest ram dropped from the host
+};
+static run_stats_t run_stats{};
+
+// sleeps until timeout_us passed (0 waits for a wake only) or idle_wake
+void idle_wait(uint64_t timeout_us) {
+  uint64_t start = get_time_now_us();
+  itimerspec spec{};
+  spec.it_value.tv_sec  = timeout_us / 1000000;
+  spec.it_value.tv_nsec = (timeout_us % 1000000) * 1000;
+  timerfd_settime(idle_timer_fd, 0, &spec, nullptr);
+  epoll_event events[2];
+  int         count = epoll_wait(idle_epoll_fd, events, 2, -1);
+  for (int i = 0; i < count; i++) {
+    uint64_t drain;
+    (void)!read(events[i].data.fd, &drain, sizeof(drain));
+  }
+  run_stats._idle_us += get_time_now_us() - start;
+  run_stats._idle_waits++;
+}
+
+// host side of the uart, stdin is read by uart_reader_thread and console
+// output is written by uart_writer_thread, so guest mmio never does syscalls
+spsc_ring_t<uint8_t, 4096>         uart_rx;
+spsc_ring_t<uint8_t, 65536>        uart_tx;
+// with --record stdin lands here first, see record_host_input
+static spsc_ring_t<uint8_t, 4096>  uart_host_rx;
+static std::atomic<bool>           uart_writer_sleeping{false};
+static int                         console_log_fd = -1;
+
+void uart_reader_thread() {
+  uint8_t buffer[256];
+  auto   &rx = options._record_path.empty() ? uart_rx : uart_host_rx;
+  while (true) {
+    ssize_t rread = read(fileno(stdin), buffer, sizeof(buffer));
+    if (rread <= 0) return;
+    for (ssize_t i = 0; i < rread; i++)
+      while (!rx.push(buffer[i]))
+        std::this_thread::sleep_for(std::chrono::microseconds(1000));
+    idle_wake();
+  }
+}
+
+void write_all(int fd, const uint8_t *data, uint64_t size) {
+  while (size) {
+    ssize_t written = write(fd, data, size);
+    if (written <= 0) return;
+    data += written;
+    size -= written;
+  }
+}
+
+void uart_writer_thread() {
+  while (true) {
+    uint64_t       count;
+    const uint8_t *data = uart_tx.peek(count);
+    if (!count) {
+      uart_writer_sleeping.store(true);
+      // pairs with the fence in write_uart_byte, either the writer sees the
+      // flag or this sees the byte
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (uart_tx.empty()) uart_writer_sleeping.wait(true);
+      uart_writer_sleeping.store(false);
+      continue;
+    }
+    // everything the guest wrote since the last wake up goes out in one write
+    write_all(fileno(stdout), data, count);
+    if (console_log_fd >= 0) write_all(console_log_fd, data, count);
+    uart_tx.consume(count);
+  }
+}
+
+void start_uart_threads() {
+  if (!options._console_log_path.empty()) {
+    console_log_fd = open(options._console_log_path.c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (console_log_fd < 0)
+      throw std::runtime_error("Failed to open console log: " +
+                               options._console_log_path);
+  }
+  // the benchmark driver types into the guest instead of stdin, clones can
+  // not share it and a replay takes its input from the log
+  if (options._bench_path.empty() && !options._clones &&
+      options._replay_path.empty())
+    std::thread{uart_reader_thread}.detach();
+  std::thread{uart_writer_thread}.detach();
+}
+
+// waits (bounded) for the writer thread to drain pending console output
+void flush_uart() {
+  for (int i = 0; i < 1000 && !uart_tx.empty(); i++)
+    std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+// retired instructions since boot, updated after every step batch
+static uint64_t total_instructions = 0;
+
+// end to end guest benchmark, each phase ends when its marker shows up on
+// the console, workload phases type their command into the guest shell
+struct bench_phase_t {
+  const char *_name;
+  const char *_command;  // nullptr for boot milestones
+  const char *_marker;
+};
+// typed as @@dem-bench-''done so the echoed command line does not match
+constexpr const char   *bench_done_marker = "@@dem-bench-done";
+constexpr bench_phase_t bench_phases[]    = {
+    {"earlycon", nullptr, "earlycon:"},
+    {"kernel", nullptr, "Run /init as init process"},
+    {"userspace", nullptr, "# "},
+    {"cpu_loop", "i=0; while [ $i -lt 20000 ]; do i=$((i+1)); done",
+     bench_done_marker},
+    {"memcpy", "dd if=/dev/zero of=/dev/null bs=64k count=4096 2>/dev/null",
+     bench_done_marker},
+    {"fork_exec",
+     "i=0; while [ $i -lt 500 ]; do /bin/true; i=$((i+1)); done",
+     bench_done_marker},
+    {"console_flood", "seq 1 20000", bench_done_marker},
+    {"framebuffer_fill",
+     "for i in 1 2 3 4 5 6 7 8; do "
+     "dd if=/dev/zero of=/dev/fb0 bs=2400 count=400 2>/dev/null; done",
+     bench_done_marker},
+};
+constexpr uint64_t bench_num_phases = std::size(bench_phases);
+constexpr uint64_t bench_timeout_us = 600ull * 1000 * 1000;  // per phase
+
+struct bench_result_t {
+  uint64_t _wall_us;
+  uint64_t _instructions;
+};
+struct bench_t {
+  uint64_t                    _phase              = 0;
+  std::string                 _window;  // tail of the console output
+  bool                        _marker_seen        = false;
+  uint64_t                    _start_us           = 0;
+  uint64_t                    _start_instructions = 0;
+  std::string                 _input;  // command line still to be typed
+  uint64_t                    _input_pos          = 0;
+  std::vector<bench_result_t> _results;
+};
+static bench_t bench;
+
+// called for every console byte while benchmarking
+void bench_observe(uint8_t byte) {
+  if (bench._phase >= bench_num_phases || bench._marker_seen) return;
+  bench._window.push_back(byte);
+  if (bench._window.size() > 64) bench._window.erase(0, 1);
+  if (bench._window.ends_with(bench_phases[bench._phase]._marker)) {
+    bench._marker_seen = true;
+    bench._window.clear();
+  }
+}
+
+// types as much of the phase command as the rx ring takes, the run loop is
+// the ring's only consumer so the rest waits for the next bench_poll
+void bench_feed_input() {
+  while (bench._input_pos < bench._input.size() &&
+         uart_rx.push(bench._input[bench._input_pos]))
+    bench._input_pos++;
+}
+
+void bench_start_phase(uint64_t now_us) {
+  bench._start_us           = now_us;
+  bench._start_instructions = total_instructions;
+  const char *command       = bench_phases[bench._phase]._command;
+  bench._input     = command ? command + "; echo @@dem-bench-''done\n"s : "";
+  bench._input_pos = 0;
+  bench_feed_input();
+}
+
+void bench_write_results(bool timed_out) {
+  std::string json = "{\"phases\": [";
+  uint64_t    total_us = 0, total_inst = 0;
+  for (uint64_t i = 0; i < bench._results.size(); i++) {
+    const bench_result_t &result = bench._results[i];
+    total_us += result._wall_us;
+    total_inst += result._instructions;
+    json += std::format(
+        "{}{{\"name\": \"{}\", \"wall_us\": {}, \"instructions\": {}, "
+        "\"mips\": {:.3f}}}",
+        i ? ", " : "", bench_phases[i]._name, result._wall_us,
+        result._instructions,
+        result._wall_us ? double(result._instructions) / result._wall_us : 0.0);
+  }
+  json += std::format(
+      "], \"total\": {{\"wall_us\": {}, \"instructions\": {}, \"mips\": "
+      "{:.3f}}}, \"timed_out\": {}}}\n",
+      total_us, total_inst, total_us ? double(total_inst) / total_us : 0.0,
+      timed_out ? "true" : "false");
+  std::ofstream file(options._bench_path, std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open bench output: " +
+                             options._bench_path);
+  file << json;
+}
+
+// called from the run loop between step batches, exits once every phase ran
+void bench_poll() {
+  uint64_t now_us = get_time_now_us();
+  bench_feed_input();
+  if (bench._marker_seen) {
+    bench._results.push_back(
+        {._wall_us      = now_us - bench._start_us,
+         ._instructions = total_instructions - bench._start_instructions});
+    std::cerr << "\n[dem] bench phase " << bench_phases[bench._phase]._name
+              << " done\n";
+    bench._marker_seen = false;
+    if (++bench._phase == bench_num_phases) {
+      bench_write_results(false);
+      exit(0);
+    }
+    bench_start_phase(now_us);
+  } else if (now_us - bench._start_us > bench_timeout_us) {
+    std::cerr << "\n[dem] bench phase " << bench_phases[bench._phase]._name
+              << " timed out\n";
+    bench_write_results(true);
+    exit(1);
+  }
+}
+
+void write_uart_byte(uint8_t byte) {
+  if (!options._bench_path.empty()) bench_observe(byte);
+  while (!uart_tx.push(byte)) std::this_thread::yield();
+  // the push is a release store, keep the flag load from passing it
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (uart_writer_sleeping.load()) {
+    uart_writer_sleeping.store(false);
+    uart_writer_sleeping.notify_one();
+  }
+}
+
+constexpr uint64_t plic_mmio_start = 0x0c000000;
+constexpr uint64_t plic_mmio_stop  = 0x10000000;
+plic_t plic{};
+
+// recompute the cached best source from the summary bitmap, only visits words
+// that have pending and enabled sources
+void plic_update_best() {
+  uint32_t best_id      = 0;
+  uint32_t max_priority = plic._threshold;
+  for (uint32_t summary = plic._summary; summary; summary &= summary - 1) {
+    uint32_t word_idx = std::countr_zero(summary);
+    for (uint32_t bits = plic._pending[word_idx] & plic._enable[word_idx]; bits;
+         bits &= bits - 1) {
+      uint32_t id = word_idx * 32 + std::countr_zero(bits);
+      if (id == 0) continue;  // id 0 is reserved/null
+      if (plic._priority[id] > max_priority) {
+        max_priority = plic._priority[id];
+        best_id      = id;
+      }
+    }
+  }
+  plic._best = best_id;
+}
+
+// must be called after _pending or _enable of word_idx changes
+void plic_update_word(uint32_t word_idx) {
+  if (plic._pending[word_idx] & plic._enable[word_idx])
+    plic._summary |= 1u << word_idx;
+  else
+    plic._summary &= ~(1u << word_idx);
+  plic_update_best();
+}
+
+void plic_set_pending(uint32_t id, bool pending) {
+  uint32_t word_idx = id / 32;
+  uint32_t bit_mask = 1u << (id % 32);
+  uint32_t old      = plic._pending[word_idx];
+  if (pending)
+    plic._pending[word_idx] |= bit_mask;
+  else
+    plic._pending[word_idx] &= ~bit_mask;
+  if (old != plic._pending[word_idx]) plic_update_word(word_idx);
+}
+
+// level triggered sources, eg the uart, call this whenever their line may
+// have changed
+void plic_set_level(uint32_t id, bool level) {
+  uint32_t word_idx = id / 32;
+  uint32_t bit_mask = 1u << (id % 32);
+  if (level) {
+    plic._level[word_idx] |= bit_mask;
+    if (!(plic._claimed[word_idx] & bit_mask)) plic_set_pending(id, true);
+  } else {
+    plic._level[word_idx] &= ~bit_mask;
+    plic_set_pending(id, false);
+  }
+}
+
+// devices completing work on host threads can not touch the plic, they set
+// their source here and the run loop moves it into plic._pending
+static std::atomic<uint32_t> async_irqs{0};
+void raise_irq_async(uint32_t id) {
+  async_irqs.fetch_or(1u << id, std::memory_order_release);
+  idle_wake();
+}
+
+constexpr dawn::mmio_handler_t plic_handler{
+    ._start  = plic_mmio_start,
+    ._stop   = plic_mmio_stop,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      uint64_t offset = addr - plic_mmio_start;
+      if (offset < 0x1000) {  // priority
+        return plic._priority[offset >> 2];
+      } else if (offset >= 0x1000 && offset < 0x1080) {  // pending
+        return plic._pending[(offset - 0x1000) >> 2];
+      } else if (offset >= 0x2000 && offset < 0x2100) {  // enable
+        return plic._enable[(offset & 0x7f) >> 2];
+      } else if (offset >= 0x200000) {  // threashold & claim/complete
+        uint64_t reg_type = offset & 0xfff;
+        if (reg_type == 0) return plic._threshold;
+        if (reg_type == 4) {  // claim
+          uint32_t best_id = plic._best;
+          if (best_id > 0) {  // clear pending
+            plic._claimed[best_id / 32] |= 1u << (best_id % 32);
+            run_stats._plic_claims++;
+            plic_set_pending(best_id, false);
+          }
+          return best_id;
+        }
+      }
+      return 0;
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          uint64_t offset = addr - plic_mmio_start;
+          uint32_t val32  = static_cast<uint32_t>(value);
+          if (offset < 0x1000) {  // priority
+            uint32_t source = offset >> 2;
+            if (source > 0 && source < 1024) {
+              plic._priority[source] = val32;
+              plic_update_best();
+            }
+          } else if (offset >= 0x1000 && offset < 0x1080) {
+            // readonly, ignore writes
+          } else if (offset >= 0x2000 && offset < 0x2100) {
+            uint32_t reg_idx      = (offset & 0x7f) >> 2;
+            plic._enable[reg_idx] = val32;
+            plic_update_word(reg_idx);
+          } else if (offset >= 0x200000) {
+            uint32_t reg_type = offset & 0xfff;
+            if (reg_type == 0) {
+              plic._threshold = val32;
+              plic_update_best();
+            } else if (reg_type == 4 && val32 > 0 && val32 < 1024) {
+              // complete, a still asserted level source is pending again
+              uint32_t word_idx = val32 / 32;
+              uint32_t bit_mask = 1u << (val32 % 32);
+              plic._claimed[word_idx] &= ~bit_mask;
+              if (plic._level[word_idx] & bit_mask)
+                plic_set_pending(val32, true);
+            }
+          }
+        }};
+
+constexpr uint64_t             uart_mmio_start    = 0x10000000;
+constexpr uint64_t             uart_mmio_stop     = 0x10000100;
+constexpr uint64_t             timebase_frequency = 1000000;
+constexpr uint32_t             uart_irq           = 10;
+
+// 16550a with byte registers (reg-shift 0). received bytes move from the host
+// ring into the 16 byte rx fifo, transmitted bytes go straight to the host
+// ring so the tx fifo drains immediately and thr is always empty
+constexpr uint32_t uart_fifo_size           = 16;
+constexpr uint8_t  uart_ier_rx_available    = 0x01;
+constexpr uint8_t  uart_ier_thr_empty       = 0x02;
+constexpr uint8_t  uart_iir_no_interrupt    = 0x01;
+constexpr uint8_t  uart_iir_thr_empty       = 0x02;
+constexpr uint8_t  uart_iir_rx_available    = 0x04;
+constexpr uint8_t  uart_iir_rx_timeout      = 0x0c;
+constexpr uint8_t  uart_iir_fifo_enabled    = 0xc0;
+constexpr uint8_t  uart_fcr_fifo_enable     = 0x01;
+constexpr uint8_t  uart_fcr_clear_rx        = 0x02;
+constexpr uint8_t  uart_lcr_dlab            = 0x80;
+constexpr uint8_t  uart_lsr_data_ready      = 0x01;
+constexpr uint8_t  uart_lsr_thr_empty       = 0x20;
+constexpr uint8_t  uart_lsr_tx_empty        = 0x40;
+constexpr uint8_t  uart_msr_cts_dsr_dcd     = 0xb0;
+constexpr uint8_t  uart_rx_trigger_levels[] = {1, 4, 8, 14};
+
+struct uart_t {
+  uint8_t _rx_fifo[uart_fifo_size];
+  uint8_t _rx_head;
+  uint8_t _rx_count;
+  uint8_t _ier;
+  uint8_t _fcr;
+  uint8_t _lcr;
+  uint8_t _mcr;
+  uint8_t _scr;
+  uint8_t _dll;
+  uint8_t _dlm;
+  // thr empty interrupt, cleared by reading it from iir or writing thr
+  uint8_t _thr_empty_pending;
+};
+static uart_t uart{};
+
+uint8_t uart_iir() {
+  uint8_t fifo =
+      (uart._fcr & uart_fcr_fifo_enable) ? uart_iir_fifo_enabled : 0;
+  uint8_t trigger = (uart._fcr & uart_fcr_fifo_enable)
+                        ? uart_rx_trigger_levels[uart._fcr >> 6]
+                        : 1;
+  if (uart._ier & uart_ier_rx_available) {
+    if (uart._rx_count >= trigger) return fifo | uart_iir_rx_available;
+    // below the trigger level, the character timeout fires right away
+    if (uart._rx_count) return fifo | uart_iir_rx_timeout;
+  }
+  if ((uart._ier & uart_ier_thr_empty) && uart._thr_empty_pending)
+    return fifo | uart_iir_thr_empty;
+  return fifo | uart_iir_no_interrupt;
+}
+
+// refill the rx fifo from the host ring and update the interrupt line
+void uart_update() {
+  uint8_t depth = (uart._fcr & uart_fcr_fifo_enable) ? uart_fifo_size : 1;
+  uint8_t byte;
+  while (uart._rx_count < depth && uart_rx.pop(byte))
+    uart._rx_fifo[(uart._rx_head + uart._rx_count++) % uart_fifo_size] = byte;
+  plic_set_level(uart_irq, !(uart_iir() & uart_iir_no_interrupt));
+}
+
+constexpr dawn::mmio_handler_t uart_handler{
+    ._start  = uart_mmio_start,
+    ._stop   = uart_mmio_stop,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      uint64_t value = 0;
+      bool     dlab  = uart._lcr & uart_lcr_dlab;
+      switch (addr - uart_mmio_start) {
+        case 0:  // rbr
+          if (dlab) return uart._dll;
+          if (uart._rx_count) {
+            value         = uart._rx_fifo[uart._rx_head];
+            uart._rx_head = (uart._rx_head + 1) % uart_fifo_size;
+            uart._rx_count--;
+          }
+          break;
+        case 1: return dlab ? uart._dlm : uart._ier;
+        case 2:  // iir
+          value = uart_iir();
+          if ((value & 0x0f) == uart_iir_thr_empty)
+            uart._thr_empty_pending = 0;
+          break;
+        case 3: return uart._lcr;
+        case 4: return uart._mcr;
+        case 5:  // lsr
+          return uart_lsr_thr_empty | uart_lsr_tx_empty |
+                 (uart._rx_count ? uart_lsr_data_ready : 0);
+        case 6: return uart_msr_cts_dsr_dcd;
+        case 7: return uart._scr;
+      }
+      uart_update();
+      return value;
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          bool dlab = uart._lcr & uart_lcr_dlab;
+          switch (addr - uart_mmio_start) {
+            case 0:  // thr
+              if (dlab) {
+                uart._dll = value;
+                return;
+              }
+              write_uart_byte(value);
+              // drained to the host ring, so thr is empty again
+              uart._thr_empty_pending = 1;
+              break;
+            case 1:
+              if (dlab) {
+                uart._dlm = value;
+                return;
+              }
+              // enabling the thr empty interrupt fires it, thr is empty
+              if (value & ~uart._ier & uart_ier_thr_empty)
+                uart._thr_empty_pending = 1;
+              uart._ier = value & 0x0f;
+              break;
+            case 2:  // fcr
+              if (value & uart_fcr_clear_rx) uart._rx_count = 0;
+              uart._fcr = value & 0xc9;
+              break;
+            case 3: uart._lcr = value; return;
+            case 4: uart._mcr = value; return;
+            case 7: uart._scr = value; return;
+          }
+          uart_update();
+        }};
+
+// instructions that count towards mtime in icount mode, jumps forward when
+// the guest idles in wfi
+static uint64_t virtual_instructions = 0;
+
+static uint64_t                timercmp         = 0;
+static uint64_t                timer            = 0;
+static uint64_t                boot_time        = 0;
+constexpr uint64_t             clint_mmio_start = 0x11000000;
+constexpr uint64_t             clint_mmio_stop  = 0x11010000;
+constexpr dawn::mmio_handler_t clint_handler{
+    ._start  = clint_mmio_start,
+    ._stop   = clint_mmio_stop,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      if (addr == clint_mmio_start) {  // msip
+        return (machine->read_csr(dawn::MIP) >> 3) & 1;
+      } else if (addr == clint_mmio_start + 0x4000) {  // mtimercmp
+        return timercmp;
+      } else if (addr == clint_mmio_start + 0xbff8) {  // mtimer
+        return timer;
+      }
+      return 0;
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          if (addr == clint_mmio_start) {  // msip
+            if (value & 1)
+              machine->_csr[dawn::MIP] |= (1ull << 3);
+            else
+              machine->_csr[dawn::MIP] &= ~(1ull << 3);
+          } else if (addr == clint_mmio_start + 0x4000) {  // mtimercmp
+            timercmp = value;
+            if (timer >= timercmp) {
+              machine->_csr[dawn::MIP] |= (1ull << 7);
+            } else {
+              machine->_csr[dawn::MIP] &= ~(1ull << 7);
+            }
+          } else if (addr == clint_mmio_start + 0xbff8) {  // mtimer
+            // move the time base so later reads continue from value
+            timer = value;
+            if (options._icount)
+              virtual_instructions = value * options._icount;
+            else
+              boot_time = get_time_now_us() - value;
+          }
+        }};
+
+constexpr uint64_t framebuffer_mmio_start = 0x50000000;
+constexpr uint64_t width                  = 600;
+constexpr uint64_t height                 = 400;
+constexpr uint64_t stride                 = width * 4;
+constexpr uint64_t framebuffer_mmio_stop =
+    framebuffer_mmio_start + (width * height * 4);
+constexpr uint64_t framebuffer_size =
+    framebuffer_mmio_stop - framebuffer_mmio_start;
+// guest physical address of the framebuffer, top of guest ram with --fb-ram
+static uint64_t framebuffer_addr = framebuffer_mmio_start;
+// host copy of the framebuffer, written by framebuffer_handler or, with
+// --fb-ram, refreshed from guest ram by poll_framebuffer_ram. only the run
+// loop touches it, the present thread reads framebuffer_front
+uint8_t framebuffer[width * height * 4];
+// one bit per framebuffer row changed since the last published frame
+constexpr uint64_t framebuffer_dirty_words = (height + 63) / 64;
+uint64_t           framebuffer_dirty[framebuffer_dirty_words];
+inline void        mark_framebuffer_row_dirty(uint64_t row) {
+  framebuffer_dirty[row / 64] |= 1ull << (row % 64);
+}
+constexpr dawn::mmio_handler_t framebuffer_handler{
+    ._start  = framebuffer_mmio_start,
+    ._stop   = framebuffer_mmio_stop,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      uint64_t offset = addr - framebuffer_mmio_start;
+      return *reinterpret_cast<uint64_t *>(&framebuffer[offset]);
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          uint64_t offset = addr - framebuffer_mmio_start;
+          *reinterpret_cast<uint64_t *>(&framebuffer[offset]) = value;
+          uint64_t first_row = offset / stride;
+          uint64_t last_row  = std::min((offset + 7) / stride, height - 1);
+          mark_framebuffer_row_dirty(first_row);
+          if (last_row != first_row) mark_framebuffer_row_dirty(last_row);
+        }};
+
+// with --fb-ram guest stores hit ram at full speed and nothing is notified,
+// so every published frame diffs the whole framebuffer (about 1 MB) against
+// the host copy. a guest that retired nothing since the last diff has not
+// drawn, and a screen unchanged for a second is only diffed every 8th frame
+static uint64_t fb_ram_diffed_at = UINT64_MAX;  // total_instructions
+static uint64_t fb_ram_unchanged = 0;           // consecutive unchanged diffs
+static uint64_t fb_ram_frames    = 0;
+void poll_framebuffer_ram() {
+  if (total_instructions == fb_ram_diffed_at) return;
+  if (fb_ram_unchanged >= 30 && fb_ram_frames++ % 8) return;
+  fb_ram_diffed_at = total_instructions;
+  uint8_t row[stride];
+  bool    changed = false;
+  for (uint64_t y = 0; y < height; y++) {
+    machine->memcpy_guest_to_host(row, framebuffer_addr + y * stride, stride);
+    if (std::memcmp(row, framebuffer + y * stride, stride)) {
+      std::memcpy(framebuffer + y * stride, row, stride);
+      mark_framebuffer_row_dirty(y);
+      changed = true;
+    }
+  }
+  fb_ram_unchanged = changed ? 0 : fb_ram_unchanged + 1;
+}
+
+// the present thread converts frames from framebuffer_front, which the run
+// loop brings up to date between batches when asked, so a converted frame
+// never mixes rows from before and after a guest store. the present thread
+// holds the lock while converting and the run loop only tries it, a busy
+// lock leaves the request pending for the next batch
+uint8_t           framebuffer_front[width * height * 4];
+uint64_t          framebuffer_front_dirty[framebuffer_dirty_words];
+std::mutex        framebuffer_front_lock;
+std::atomic<bool> framebuffer_frame_requested{false};
+
+void publish_framebuffer_frame() {
+  std::unique_lock lock(framebuffer_front_lock, std::try_to_lock);
+  if (!lock) return;
+  if (options._fb_ram) poll_framebuffer_ram();
+  for (uint64_t row = 0; row < height; row++) {
+    if (framebuffer_dirty[row / 64] & (1ull << (row % 64)))
+      std::memcpy(framebuffer_front + row * stride, framebuffer + row * stride,
+                  stride);
+  }
+  for (uint64_t i = 0; i < framebuffer_dirty_words; i++) {
+    framebuffer_front_dirty[i] |= framebuffer_dirty[i];
+    framebuffer_dirty[i] = 0;
+  }
+  framebuffer_frame_requested.store(false, std::memory_order_relaxed);
+}
+
+// guest writes any value here to request a snapshot, eg from a booted shell:
+// devmem 0x11100000 32 1
+// reading offset 8 returns the clone index (1 based, 0 when not cloned) so
+// test jobs running in clones can tell themselves apart
+static std::atomic<bool>       snapshot_requested{false};
+static uint32_t                clone_index         = 0;
+constexpr uint64_t             snapshot_mmio_start = 0x11100000;
+constexpr uint64_t             snapshot_mmio_stop  = 0x11101000;
+constexpr dawn::mmio_handler_t snapshot_handler{
+    ._start  = snapshot_mmio_start,
+    ._stop   = snapshot_mmio_stop,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      if (addr == snapshot_mmio_start + 8) return clone_index;
+      return 0;
+    },
+    ._store64 = [](uint64_t addr,
+                   uint64_t value) { snapshot_requested = true; }};
+
+// sifive test finisher, the guest powers off, fails with a status or reboots
+// by writing a code to offset 0, linux does so through the syscon-poweroff
+// and syscon-reboot nodes. a failure status goes in the upper 16 bits, eg
+// devmem 0x11300000 32 $(((3 << 16) | 0x3333))
+enum power_request_t : uint8_t { power_none, power_off, power_reboot };
+constexpr uint64_t             syscon_mmio_start = 0x11300000;
+constexpr uint64_t             syscon_mmio_stop  = 0x11301000;
+constexpr uint32_t             syscon_fail       = 0x3333;
+constexpr uint32_t             syscon_pass       = 0x5555;
+constexpr uint32_t             syscon_reset      = 0x7777;
+static power_request_t         power_request     = power_none;
+static uint32_t                power_status      = 0;
+constexpr dawn::mmio_handler_t syscon_handler{
+    ._start  = syscon_mmio_start,
+    ._stop   = syscon_mmio_stop,
+    ._load64 = [](uint64_t addr) -> uint64_t { return 0; },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          if (addr != syscon_mmio_start) return;
+          switch (value & 0xffff) {
+            case syscon_fail:
+              // exit statuses are 8 bits, larger codes clamp to 255 and a
+              // failure never exits as a success
+              power_request = power_off;
+              power_status  = std::clamp<uint32_t>((value >> 16) & 0xffff, 1,
+                                                   255);
+              break;
+            case syscon_pass:
+              power_request = power_off;
+              power_status  = 0;
+              break;
+            case syscon_reset: power_request = power_reboot; break;
+          }
+        }};
+
+// guest visible counters, dawn leaves them alone. mcycle and minstret follow
+// the instructions machine->step retires, at one instruction per cycle plus
+// the cycles spent in wfi. mhpmcounter3..6 count the hpm_event_t written to
+// the matching mhpmevent
+constexpr uint16_t csr_mcountinhibit = 0x320;
+constexpr uint16_t csr_mhpmevent3    = 0x323;
+constexpr uint32_t perf_instret      = dawn::MINSTRET - dawn::MCYCLE;
+constexpr uint32_t perf_hpm_first    = 3;
+constexpr uint32_t perf_hpm_counters = 4;
+
+enum hpm_event_t : uint8_t {
+  hpm_event_none,
+  hpm_event_mmio,  // loads and stores to mmio devices
+  // mtip raised and plic claims, only interrupts dem delivers. exceptions and
+  // other traps are taken inside dawn and not counted
+  hpm_event_irq_raised,
+  hpm_event_wfi_cycles,
+  hpm_event_count,
+};
+
+static uint64_t mmio_accesses = 0;  // counted by mmio_dispatch_handler
+
+struct perf_seen_t {
+  uint64_t _mmio_accesses;
+  uint64_t _irq_raised;
+};
+static perf_seen_t perf_seen{};
+
+// adds delta to counter index (0 is mcycle) and its unprivileged alias
+void perf_add(uint32_t index, uint64_t delta) {
+  if (!delta || (machine->_csr[csr_mcountinhibit] >> index & 1)) return;
+  uint64_t &counter = machine->_csr[dawn::MCYCLE + index];
+  counter += delta;
+  machine->_csr[dawn::CYCLE + index] = counter;
+}
+
+// called from the run loop after every step
+void perf_update(uint64_t instructions, uint64_t wfi_cycles) {
+  uint64_t irq_raised = run_stats._timer_interrupts + run_stats._plic_claims;
+  uint64_t events[hpm_event_count] = {
+      0, mmio_accesses - perf_seen._mmio_accesses,
+      irq_raised - perf_seen._irq_raised, wfi_cycles};
+  perf_seen = {._mmio_accesses = mmio_accesses, ._irq_raised = irq_raised};
+  perf_add(0, instructions + wfi_cycles);
+  perf_add(perf_instret, instructions);
+  for (uint32_t i = 0; i < perf_hpm_counters; i++) {
+    uint8_t event = machine->_csr[csr_mhpmevent3 + i];
+    if (event < hpm_event_count)
+      perf_add(perf_hpm_first + i, events[event]);
+  }
+  machine->_csr[dawn::TIME] = timer;
+}
+
+template <typename T>
+T guest_load(uint64_t addr) {
+  T value;
+  machine->memcpy_guest_to_host(&value, addr, sizeof(T));
+  return value;
+}
+template <typename T>
+void guest_store(uint64_t addr, const T &value) {
+  machine->memcpy_host_to_guest(addr, &value, sizeof(T));
+}
+
+// virtio-mmio (version 2) transport with split virtqueues, shared by all
+// virtio devices, each device is one 64KiB granule at virtio_mmio_base and
+// plic source virtio_irq_base + n
+constexpr uint64_t virtio_mmio_base      = 0x10010000;
+constexpr uint64_t virtio_mmio_size      = 0x1000;
+constexpr uint32_t virtio_irq_base       = 1;
+constexpr uint32_t virtio_max_queues     = 4;
+constexpr uint32_t virtio_queue_num_max  = 256;
+constexpr uint64_t virtio_f_version_1    = 1ull << 32;
+constexpr uint16_t virtq_desc_f_next     = 1;
+constexpr uint16_t virtq_desc_f_write    = 2;
+constexpr uint32_t virtio_status_failed  = 128;
+
+struct virtqueue_t {
+  uint32_t _num;
+  uint32_t _ready;
+  uint64_t _desc;
+  uint64_t _driver;  // avail ring
+  uint64_t _device;  // used ring
+  uint16_t _last_avail;
+  uint16_t _used_idx;
+};
+
+// guest visible transport state, plain data so snapshots can copy it
+struct virtio_regs_t {
+  uint64_t    _driver_features;
+  uint32_t    _device_features_sel;
+  uint32_t    _driver_features_sel;
+  uint32_t    _queue_sel;
+  uint32_t    _status;
+  uint32_t    _interrupt_status;  // accessed through std::atomic_ref
+  uint32_t    _config_generation;
+  virtqueue_t _queues[virtio_max_queues];
+};
+
+struct virtio_device_t {
+  uint64_t      _mmio_start;
+  uint32_t      _device_id;
+  uint32_t      _irq;
+  uint32_t      _num_queues;
+  uint64_t      _device_features;
+  virtio_regs_t _regs;
+  uint8_t       _config[256];
+  uint32_t      _config_size;
+  // called from the run loop when the driver writes QueueNotify
+  void (*_notify)(virtio_device_t &device, uint32_t queue);
+  // optional, called from the run loop when the driver writes config space
+  void (*_config_store)(virtio_device_t &device, uint64_t offset,
+                        uint64_t value);
+  // held by backends while they touch the queues, and by reset and snapshots
+  std::mutex _lock;
+};
+
+struct virtq_desc_t {
+  uint64_t _addr;
+  uint32_t _len;
+  uint16_t _flags;
+  uint16_t _next;
+};
+
+// a descriptor chain popped from the avail ring, split into the buffers the
+// device reads and the buffers it writes
+struct virtq_chain_t {
+  uint16_t                  _head;
+  std::vector<virtq_desc_t> _readable;
+  std::vector<virtq_desc_t> _writable;
+};
+
+uint64_t virtq_size(const std::vector<virtq_desc_t> &descs) {
+  uint64_t size = 0;
+  for (const virtq_desc_t &desc : descs) size += desc._len;
+  return size;
+}
+
+// visits the guest segments backing [offset, offset + size) of descs, as if
+// the descriptors were one contiguous buffer, returns the bytes visited
+template <typename fn_t>
+uint64_t virtq_for_each_segment(const std::vector<virtq_desc_t> &descs,
+                                uint64_t offset, uint64_t size, fn_t &&fn) {
+  uint64_t done = 0;
+  for (const virtq_desc_t &desc : descs) {
+    if (done == size) break;
+    if (offset >= desc._len) {
+      offset -= desc._len;
+      continue;
+    }
+    uint64_t len = std::min<uint64_t>(desc._len - offset, size - done);
+    fn(desc._addr + offset, len, done);
+    done += len;
+    offset = 0;
+  }
+  return done;
+}
+
+uint64_t virtq_read(const std::vector<virtq_desc_t> &descs, uint64_t offset,
+                    void *dst, uint64_t size) {
+  return virtq_for_each_segment(
+      descs, offset, size, [&](uint64_t addr, uint64_t len, uint64_t done) {
+        machine->memcpy_guest_to_host(reinterpret_cast<uint8_t *>(dst) + done,
+                                      addr, len);
+      });
+}
+
+uint64_t virtq_write(const std::vector<virtq_desc_t> &descs, uint64_t offset,
+                     const void *src, uint64_t size) {
+  return virtq_for_each_segment(
+      descs, offset, size, [&](uint64_t addr, uint64_t len, uint64_t done) {
+        machine->memcpy_host_to_guest(
+            addr, reinterpret_cast<const uint8_t *>(src) + done, len);
+      });
+}
+
+bool virtq_pop(virtqueue_t &queue, virtq_chain_t &chain) {
+  if (!queue._ready || !queue._num) return false;
+  uint16_t avail_idx = guest_load<uint16_t>(queue._driver + 2);
+  if (queue._last_avail == avail_idx) return false;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  chain._head = guest_load<uint16_t>(
+      queue._driver + 4 + 2 * (queue._last_avail % queue._num));
+  chain._readable.clear();
+  chain._writable.clear();
+  queue._last_avail++;
+  uint16_t idx = chain._head;
+  // bounded so a looping chain can not hang the device
+  for (uint32_t i = 0; i < queue._num; i++) {
+    auto desc = guest_load<virtq_desc_t>(
+        queue._desc + sizeof(virtq_desc_t) * (idx % queue._num));
+    if (desc._flags & virtq_desc_f_write)
+      chain._writable.push_back(desc);
+    else
+      chain._readable.push_back(desc);
+    if (!(desc._flags & virtq_desc_f_next)) break;
+    idx = desc._next;
+  }
+  return true;
+}
+
+void virtq_push(virtqueue_t &queue, uint16_t head, uint32_t len) {
+  uint64_t elem = queue._device + 4 + 8 * (queue._used_idx % queue._num);
+  guest_store<uint32_t>(elem, head);
+  guest_store<uint32_t>(elem + 4, len);
+  std::atomic_thread_fence(std::memory_order_release);
+  guest_store<uint16_t>(queue._device + 2, ++queue._used_idx);
+}
+
+void virtio_raise_interrupt(virtio_device_t &device) {
+  std::atomic_ref<uint32_t>(device._regs._interrupt_status).fetch_or(1);
+  raise_irq_async(device._irq);
+}
+
+void virtio_reset(virtio_device_t &device) {
+  std::lock_guard lock{device._lock};
+  device._regs = {};
+}
+
+uint64_t virtio_mmio_load(virtio_device_t &device, uint64_t addr) {
+  uint64_t       offset = addr - device._mmio_start;
+  virtio_regs_t &regs   = device._regs;
+  if (offset >= 0x100) {  // config space, little endian bytes from offset
+    uint64_t value = 0;
+    offset -= 0x100;
+    if (offset < device._config_size)
+      std::memcpy(&value, device._config + offset,
+                  std::min<uint64_t>(8, device._config_size - offset));
+    return value;
+  }
+  virtqueue_t &queue = regs._queues[regs._queue_sel % virtio_max_queues];
+  switch (offset) {
+    case 0x000: return 0x74726976;  // magic "virt"
+    case 0x004: return 2;           // version
+    case 0x008: return device._device_id;
+    case 0x00c: return 0x4d4544;  // vendor "DEM"
+    case 0x010:
+      return regs._device_features_sel ? device._device_features >> 32
+                                       : device._device_features & 0xffffffff;
+    case 0x034:
+      return regs._queue_sel < device._num_queues ? virtio_queue_num_max : 0;
+    case 0x044: return queue._ready;
+    case 0x060:
+      return std::atomic_ref<uint32_t>(regs._interrupt_status).load();
+    case 0x070: return regs._status;
+    case 0x0fc: return regs._config_generation;
+  }
+  return 0;
+}
+
+void virtio_mmio_store(virtio_device_t &device, uint64_t addr,
+                       uint64_t value) {
+  uint64_t       offset = addr - device._mmio_start;
+  uint32_t       val32  = static_cast<uint32_t>(value);
+  virtio_regs_t &regs   = device._regs;
+  if (offset >= 0x100) {
+    if (device._config_store)
+      device._config_store(device, offset - 0x100, value);
+    return;
+  }
+  // backends walk the queues on their own threads, queue registers only
+  // change under the device lock. notify and interrupt ack stay lock free so
+  // they never wait for a busy backend
+  std::unique_lock lock{device._lock, std::defer_lock};
+  if (offset == 0x030 || offset == 0x038 || offset == 0x044 ||
+      (offset >= 0x080 && offset <= 0x0a4))
+    lock.lock();
+  bool         valid_queue = regs._queue_sel < device._num_queues;
+  virtqueue_t &queue       = regs._queues[regs._queue_sel % virtio_max_queues];
+  switch (offset) {
+    case 0x014: regs._device_features_sel = val32; break;
+    case 0x020:
+      if (regs._driver_features_sel)
+        regs._driver_features = (regs._driver_features & 0xffffffff) |
+                                (uint64_t(val32) << 32);
+      else
+        regs._driver_features =
+            (regs._driver_features & ~0xffffffffull) | val32;
+      break;
+    case 0x024: regs._driver_features_sel = val32; break;
+    case 0x030: regs._queue_sel = val32; break;
+    case 0x038:
+      if (valid_queue && val32 <= virtio_queue_num_max && val32)
+        queue._num = val32;
+      break;
+    case 0x044:
+      if (valid_queue) queue._ready = val32 & 1;
+      break;
+    case 0x050:
+      if (val32 < device._num_queues && device._notify)
+        device._notify(device, val32);
+      break;
+    case 0x064:
+      std::atomic_ref<uint32_t>(regs._interrupt_status).fetch_and(~val32);
+      break;
+    case 0x070:
+      if (val32 == 0)
+        virtio_reset(device);
+      else if ((val32 & 0x8) && !(regs._driver_features & virtio_f_version_1))
+        regs._status = val32 | virtio_status_failed;  // legacy drivers
+      else
+        regs._status = val32;
+      break;
+    case 0x080:
+      if (valid_queue) queue._desc = (queue._desc & ~0xffffffffull) | val32;
+      break;
+    case 0x084:
+      if (valid_queue)
+        queue._desc = (queue._desc & 0xffffffff) | (uint64_t(val32) << 32);
+      break;
+    case 0x090:
+      if (valid_queue)
+        queue._driver = (queue._driver & ~0xffffffffull) | val32;
+      break;
+    case 0x094:
+      if (valid_queue)
+        queue._driver = (queue._driver & 0xffffffff) | (uint64_t(val32) << 32);
+      break;
+    case 0x0a0:
+      if (valid_queue)
+        queue._device = (queue._device & ~0xffffffffull) | val32;
+      break;
+    case 0x0a4:
+      if (valid_queue)
+        queue._device = (queue._device & 0xffffffff) | (uint64_t(val32) << 32);
+      break;
+  }
+}
+
+// virtio-blk backed by a MAP_SHARED mapping of a raw image, requests are
+// served on a worker thread straight between the page cache and guest ram,
+// everything available per kick is completed with a single interrupt
+constexpr uint64_t virtio_blk_mmio_start = virtio_mmio_base;
+constexpr uint32_t virtio_blk_f_ro       = 1u << 5;
+constexpr uint32_t virtio_blk_f_flush    = 1u << 9;
+constexpr uint32_t virtio_blk_t_in       = 0;
+constexpr uint32_t virtio_blk_t_out      = 1;
+constexpr uint32_t virtio_blk_t_flush    = 4;
+constexpr uint32_t virtio_blk_t_get_id   = 8;
+constexpr uint8_t  virtio_blk_s_ok       = 0;
+constexpr uint8_t  virtio_blk_s_ioerr    = 1;
+constexpr uint8_t  virtio_blk_s_unsupp   = 2;
+constexpr uint64_t virtio_blk_sector     = 512;
+
+struct virtio_blk_req_t {
+  uint32_t _type;
+  uint32_t _reserved;
+  uint64_t _sector;
+};
+
+struct virtio_blk_disk_t {
+  uint8_t              *_data = nullptr;
+  uint64_t              _size = 0;
+  bool                  _read_only = false;
+  std::atomic<uint32_t> _kick{0};
+};
+static virtio_blk_disk_t virtio_blk_disk;
+static virtio_device_t   virtio_blk{
+      ._mmio_start = virtio_blk_mmio_start,
+      ._device_id  = 2,
+      ._irq        = virtio_irq_base,
+      ._num_queues = 1,
+      ._notify     = [](virtio_device_t &, uint32_t) {
+      virtio_blk_disk._kick.fetch_add(1, std::memory_order_release);
+      virtio_blk_disk._kick.notify_one();
+    }};
+
+uint8_t virtio_blk_request(const virtq_chain_t &chain, uint32_t &written) {
+  virtio_blk_req_t req;
+  uint64_t         writable = virtq_size(chain._writable);
+  written                   = 0;
+  if (virtq_read(chain._readable, 0, &req, sizeof(req)) != sizeof(req) ||
+      !writable)
+    return virtio_blk_s_ioerr;
+  uint64_t pos = req._sector * virtio_blk_sector;
+  switch (req._type) {
+    case virtio_blk_t_in: {
+      uint64_t len = writable - 1;
+      if (pos > virtio_blk_disk._size || len > virtio_blk_disk._size - pos)
+        return virtio_blk_s_ioerr;
+      written = virtq_write(chain._writable, 0, virtio_blk_disk._data + pos,
+                            len);
+      return virtio_blk_s_ok;
+    }
+    case virtio_blk_t_out: {
+      uint64_t len = virtq_size(chain._readable) - sizeof(req);
+      if (virtio_blk_disk._read_only) return virtio_blk_s_ioerr;
+      if (pos > virtio_blk_disk._size || len > virtio_blk_disk._size - pos)
+        return virtio_blk_s_ioerr;
+      virtq_read(chain._readable, sizeof(req), virtio_blk_disk._data + pos,
+                 len);
+      return virtio_blk_s_ok;
+    }
+    case virtio_blk_t_flush:
+      if (msync(virtio_blk_disk._data, virtio_blk_disk._size, MS_SYNC))
+        return virtio_blk_s_ioerr;
+      return virtio_blk_s_ok;
+    case virtio_blk_t_get_id: {
+      const char id[20] = "dem-virtio-blk";
+      written = virtq_write(chain._writable, 0, id,
+                            std::min<uint64_t>(sizeof(id), writable - 1));
+      return virtio_blk_s_ok;
+    }
+  }
+  return virtio_blk_s_unsupp;
+}
+
+// serves every queued request
+void virtio_blk_process() {
+  virtq_chain_t chain;
+  bool          completed = false;
+  {
+    std::lock_guard lock{virtio_blk._lock};
+    virtqueue_t    &queue = virtio_blk._regs._queues[0];
+    while (virtq_pop(queue, chain)) {
+      uint32_t written;
+      uint8_t  status = virtio_blk_request(chain, written);
+      virtq_write(chain._writable, virtq_size(chain._writable) - 1, &status,
+                  1);
+      virtq_push(queue, chain._head, written + 1);
+      completed = true;
+    }
+  }
+  if (completed) virtio_raise_interrupt(virtio_blk);
+}
+
+void virtio_blk_worker() {
+  while (true) {
+    uint32_t seen = virtio_blk_disk._kick.load(std::memory_order_acquire);
+    virtio_blk_process();
+    virtio_blk_disk._kick.wait(seen, std::memory_order_acquire);
+  }
+}
+
+void open_virtio_blk(const std::string &path, bool read_only) {
+  int fd = open(path.c_str(), read_only ? O_RDONLY : O_RDWR);
+  if (fd < 0) throw std::runtime_error("Failed to open disk: " + path);
+  struct stat st;
+  fstat(fd, &st);
+  if (!st.st_size || st.st_size % virtio_blk_sector) {
+    close(fd);
+    throw std::runtime_error("Disk size must be a non zero multiple of 512: " +
+                             path);
+  }
+  // clones each get a private copy on write view of the image
+  void *data = mmap(nullptr, st.st_size,
+                    PROT_READ | (read_only ? 0 : PROT_WRITE),
+                    options._clones ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    throw std::runtime_error("Failed to map disk: " + path);
+  virtio_blk_disk._data      = reinterpret_cast<uint8_t *>(data);
+  virtio_blk_disk._size      = st.st_size;
+  virtio_blk_disk._read_only = read_only;
+
+  virtio_blk._device_features = virtio_f_version_1 | virtio_blk_f_flush |
+                                (read_only ? virtio_blk_f_ro : 0);
+  // struct virtio_blk_config, only capacity is used
+  uint64_t capacity = st.st_size / virtio_blk_sector;
+  std::memcpy(virtio_blk._config, &capacity, sizeof(capacity));
+  virtio_blk._config_size = 24;
+}
+
+constexpr dawn::mmio_handler_t virtio_blk_handler{
+    ._start  = virtio_blk_mmio_start,
+    ._stop   = virtio_blk_mmio_start + virtio_mmio_size,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      return virtio_mmio_load(virtio_blk, addr);
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          virtio_mmio_store(virtio_blk, addr, value);
+        }};
+
+// virtio-input keyboard and absolute pointer fed by the x11 window. the
+// present thread translates x11 events into evdev events and queues them on a
+// lock free ring, the run loop moves them into the event queue
+constexpr uint64_t virtio_input_mmio_start    = virtio_mmio_base + 0x10000;
+constexpr uint8_t  virtio_input_cfg_id_name   = 0x01;
+constexpr uint8_t  virtio_input_cfg_id_devids = 0x03;
+constexpr uint8_t  virtio_input_cfg_ev_bits   = 0x11;
+constexpr uint8_t  virtio_input_cfg_abs_info  = 0x12;
+
+struct virtio_input_event_t {
+  uint16_t _type;
+  uint16_t _code;
+  uint32_t _value;
+};
+
+static spsc_ring_t<virtio_input_event_t, 1024> virtio_input_events;
+// with --record x11 input lands here first, see record_host_input
+static spsc_ring_t<virtio_input_event_t, 1024> virtio_input_host_events;
+
+// config space selector written by the driver
+static uint8_t virtio_input_select = 0;
+static uint8_t virtio_input_subsel = 0;
+
+// rebuilds struct virtio_input_config for the current select/subsel
+void virtio_input_update_config(virtio_device_t &device) {
+  uint8_t *config = device._config;
+  uint8_t *u      = config + 8;
+  uint8_t  size   = 0;
+  std::memset(config, 0, sizeof(device._config));
+  config[0] = virtio_input_select;
+  config[1] = virtio_input_subsel;
+  if (virtio_input_select == virtio_input_cfg_id_name) {
+    const char name[] = "dem-input";
+    size              = sizeof(name) - 1;
+    std::memcpy(u, name, size);
+  } else if (virtio_input_select == virtio_input_cfg_id_devids) {
+    uint16_t devids[] = {BUS_VIRTUAL, 0x4d44, 0x0001, 0x0001};
+    size              = sizeof(devids);
+    std::memcpy(u, devids, size);
+  } else if (virtio_input_select == virtio_input_cfg_ev_bits) {
+    auto set = [&](uint32_t bit) {
+      u[bit / 8] |= 1 << (bit % 8);
+      size        = std::max<uint8_t>(size, bit / 8 + 1);
+    };
+    if (virtio_input_subsel == EV_KEY) {
+      // x11 keycodes are evdev codes + 8
+      for (uint32_t key = KEY_ESC; key < 256 - 8; key++) set(key);
+      for (uint32_t button : {BTN_LEFT, BTN_RIGHT, BTN_MIDDLE}) set(button);
+    } else if (virtio_input_subsel == EV_REL) {
+      set(REL_WHEEL);
+    } else if (virtio_input_subsel == EV_ABS) {
+      set(ABS_X);
+      set(ABS_Y);
+    }
+  } else if (virtio_input_select == virtio_input_cfg_abs_info) {
+    // min, max, fuzz, flat, res
+    uint32_t absinfo[5] = {};
+    if (virtio_input_subsel == ABS_X) absinfo[1] = width - 1;
+    if (virtio_input_subsel == ABS_Y) absinfo[1] = height - 1;
+    if (absinfo[1]) {
+      size = sizeof(absinfo);
+      std::memcpy(u, absinfo, size);
+    }
+  }
+  config[2] = size;
+}
+
+// called from the present thread
+void virtio_input_queue_event(uint16_t type, uint16_t code, uint32_t value) {
+  // a replayed guest only gets the logged input
+  if (!options._replay_path.empty()) return;
+  auto &events = options._record_path.empty() ? virtio_input_events
+                                              : virtio_input_host_events;
+  // a guest that stopped reading input loses events instead of stalling x11
+  events.push({._type = type, ._code = code, ._value = value});
+  if (type == EV_SYN) idle_wake();
+}
+
+// delivers queued events into the buffers the driver posted on the event
+// queue, called from the run loop
+void virtio_input_flush(virtio_device_t &device) {
+  virtqueue_t  &queue     = device._regs._queues[0];
+  bool          delivered = false;
+  virtq_chain_t chain;
+  while (!virtio_input_events.empty() && virtq_pop(queue, chain)) {
+    uint64_t                    count;
+    const virtio_input_event_t *event = virtio_input_events.peek(count);
+    virtq_write(chain._writable, 0, event, sizeof(*event));
+    virtq_push(queue, chain._head, sizeof(*event));
+    virtio_input_events.consume(1);
+    delivered = true;
+  }
+  if (delivered) virtio_raise_interrupt(device);
+}
+
+static virtio_device_t virtio_input{
+    ._mmio_start      = virtio_input_mmio_start,
+    ._device_id       = 18,
+    ._irq             = virtio_irq_base + 1,
+    ._num_queues      = 2,
+    ._device_features = virtio_f_version_1,
+    ._config_size     = 8 + 128,
+    ._notify =
+        [](virtio_device_t &device, uint32_t queue) {
+          if (queue == 0) {
+            virtio_input_flush(device);
+            return;
+          }
+          // status queue (leds), consumed and ignored
+          virtq_chain_t chain;
+          bool          consumed = false;
+          while (virtq_pop(device._regs._queues[1], chain)) {
+            virtq_push(device._regs._queues[1], chain._head, 0);
+            consumed = true;
+          }
+          if (consumed) virtio_raise_interrupt(device);
+        },
+    ._config_store =
+        [](virtio_device_t &device, uint64_t offset, uint64_t value) {
+          if (offset == 0)
+            virtio_input_select = value;
+          else if (offset == 1)
+            virtio_input_subsel = value;
+          virtio_input_update_config(device);
+        }};
+
+constexpr dawn::mmio_handler_t virtio_input_handler{
+    ._start  = virtio_input_mmio_start,
+    ._stop   = virtio_input_mmio_start + virtio_mmio_size,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      return virtio_mmio_load(virtio_input, addr);
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          virtio_mmio_store(virtio_input, addr, value);
+        }};
+
+// virtio-9p serving a host directory with 9P2000.L, so a guest can mount (or
+// boot from) a live host tree instead of a repacked cpio:
+//   mount -t 9p -o trans=virtio,version=9p2000.L <tag> /mnt
+// fids name paths relative to the shared root and every access resolves them
+// beneath it with openat2, so neither ".." nor a symlink leaves the share,
+// device nodes can't be created in it. requests are served on a
+// worker thread like virtio-blk, reads go from the host page cache through
+// one bounce buffer into guest ram
+constexpr uint64_t virtio_9p_mmio_start   = virtio_mmio_base + 0x20000;
+constexpr uint64_t virtio_9p_f_mount_tag  = 1;
+constexpr uint32_t p9_max_msize           = 512 * 1024;
+constexpr uint32_t p9_min_msize           = 4096;
+constexpr uint32_t p9_header_size         = 7;  // size[4] type[1] tag[2]
+constexpr uint32_t p9_nofid               = ~0u;
+constexpr uint8_t  p9_qid_dir             = 0x80;
+constexpr uint8_t  p9_qid_symlink         = 0x02;
+constexpr uint64_t p9_getattr_basic       = 0x7ff;
+
+enum p9_message_t : uint8_t {
+  p9_rlerror    = 7,
+  p9_tstatfs    = 8,
+  p9_tlopen     = 12,
+  p9_tlcreate   = 14,
+  p9_tsymlink   = 16,
+  p9_tmknod     = 18,
+  p9_trename    = 20,
+  p9_treadlink  = 22,
+  p9_tgetattr   = 24,
+  p9_tsetattr   = 26,
+  p9_txattrwalk = 30,
+  p9_treaddir   = 40,
+  p9_tfsync     = 50,
+  p9_tlock      = 52,
+  p9_tgetlock   = 54,
+  p9_tlink      = 70,
+  p9_tmkdir     = 72,
+  p9_trenameat  = 74,
+  p9_tunlinkat  = 76,
+  p9_tversion   = 100,
+  p9_tattach    = 104,
+  p9_tflush     = 108,
+  p9_twalk      = 110,
+  p9_tread      = 116,
+  p9_twrite     = 118,
+  p9_tclunk     = 120,
+};
+
+struct p9_fid_t {
+  std::string _path;  // relative to the shared root, "" is the root
+  int         _fd  = -1;
+  DIR        *_dir = nullptr;  // readdir stream over a dup of _fd
+};
+
+struct virtio_9p_server_t {
+  std::string                  _root;
+  int                          _root_fd = -1;  // O_PATH
+  std::string                  _tag;
+  uint32_t                     _msize = 8192;
+  std::map<uint32_t, p9_fid_t> _fids;
+  std::vector<uint8_t>         _request;
+  std::atomic<uint32_t>        _kick{0};
+};
+static virtio_9p_server_t virtio_9p_server;
+
+// failed requests unwind to the dispatcher as an errno
+struct p9_error_t {
+  uint32_t _errno;
+};
+
+struct p9_reader_t {
+  const uint8_t *_data;
+  uint64_t       _size;
+  uint64_t       _pos = p9_header_size;
+
+  template <typename T>
+  T get() {
+    T value;
+    if (_pos + sizeof(T) > _size) throw p9_error_t{EPROTO};
+    std::memcpy(&value, _data + _pos, sizeof(T));
+    _pos += sizeof(T);
+    return value;
+  }
+  std::string get_string() {
+    uint16_t length = get<uint16_t>();
+    if (_pos + length > _size) throw p9_error_t{EPROTO};
+    std::string value(reinterpret_cast<const char *>(_data + _pos), length);
+    _pos += length;
+    return value;
+  }
+};
+
+struct p9_writer_t {
+  std::vector<uint8_t> _data;
+
+  template <typename T>
+  void put(T value) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+    _data.insert(_data.end(), bytes, bytes + sizeof(T));
+  }
+  void put_string(const std::string &value) {
+    put<uint16_t>(value.size());
+    _data.insert(_data.end(), value.begin(), value.end());
+  }
+  void put_qid(const struct stat &st) {
+    uint8_t type = S_ISDIR(st.st_mode)   ? p9_qid_dir
+                   : S_ISLNK(st.st_mode) ? p9_qid_symlink
+                                         : 0;
+    put<uint8_t>(type);
+    put<uint32_t>(st.st_mtime ^ (st.st_size << 8));
+    put<uint64_t>(st.st_ino);
+  }
+};
+
+p9_fid_t &p9_get_fid(uint32_t fid) {
+  auto it = virtio_9p_server._fids.find(fid);
+  if (it == virtio_9p_server._fids.end()) throw p9_error_t{EBADF};
+  return it->second;
+}
+
+void p9_close_fid(p9_fid_t &fid) {
+  if (fid._dir) closedir(fid._dir);
+  if (fid._fd >= 0) close(fid._fd);
+  fid._dir = nullptr;
+  fid._fd  = -1;
+}
+
+void p9_clunk(uint32_t fid) {
+  auto it = virtio_9p_server._fids.find(fid);
+  if (it == virtio_9p_server._fids.end()) return;
+  p9_close_fid(it->second);
+  virtio_9p_server._fids.erase(it);
+}
+
+// a single path element below dir, names that could leave it are rejected
+std::string p9_child_path(const std::string &dir, const std::string &name) {
+  if (name.empty() || name == "." || name == ".." ||
+      name.find('/') != std::string::npos)
+    throw p9_error_t{EINVAL};
+  return dir.empty() ? name : dir + "/" + name;
+}
+
+// checks a syscall result, turning failures into the guest visible errno
+int p9_check(int result) {
+  if (result < 0) throw p9_error_t{static_cast<uint32_t>(errno)};
+  return result;
+}
+
+// opens path with the host resolving it beneath the shared root, a ".." or
+// symlink that would lead out of it fails with EXDEV
+int p9_open(const std::string &path, int flags, uint32_t mode = 0) {
+  open_how how{.flags   = static_cast<uint64_t>(flags),
+               .mode    = mode,
+               .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+  return p9_check(syscall(SYS_openat2, virtio_9p_server._root_fd,
+                          path.empty() ? "." : path.c_str(), &how,
+                          sizeof(how)));
+}
+
+// closes a host fd when the request unwinds
+struct p9_fd_t {
+  int _fd = -1;
+  ~p9_fd_t() {
+    if (_fd >= 0) close(_fd);
+  }
+};
+
+// the parent directory of path opened beneath the root and its last element,
+// for *at calls that act on the entry itself and never follow it
+struct p9_at_t {
+  p9_fd_t     _dir;
+  std::string _name;
+};
+
+p9_at_t p9_at(const std::string &path) {
+  auto        slash  = path.rfind('/');
+  std::string parent = slash == std::string::npos ? "" : path.substr(0, slash);
+  return {{p9_open(parent, O_PATH | O_DIRECTORY | O_CLOEXEC)},
+          path.empty() ? "." : path.substr(slash + 1)};
+}
+
+struct stat p9_lstat(const std::string &path) {
+  struct stat st;
+  p9_at_t     at = p9_at(path);
+  p9_check(fstatat(at._dir._fd, at._name.c_str(), &st, AT_SYMLINK_NOFOLLOW));
+  return st;
+}
+
+// translates the linux open flags of the guest for the host, the values are
+// the same as on the host but only some of them make sense to pass through
+int p9_open_flags(uint32_t flags) {
+  return (flags & (O_ACCMODE | O_APPEND | O_TRUNC | O_CREAT | O_EXCL |
+                   O_NONBLOCK | O_DIRECTORY | O_NOFOLLOW | O_SYNC)) |
+         O_CLOEXEC;
+}
+
+void p9_readdir(p9_fid_t &fid, uint64_t offset, uint32_t count,
+                p9_writer_t &reply) {
+  if (fid._fd < 0) throw p9_error_t{EBADF};
+  if (!fid._dir) {
+    int fd = p9_check(dup(fid._fd));
+    fid._dir = fdopendir(fd);
+    if (!fid._dir) {
+      close(fd);
+      throw p9_error_t{static_cast<uint32_t>(errno)};
+    }
+  }
+  if (offset == 0)
+    rewinddir(fid._dir);
+  else
+    seekdir(fid._dir, offset);
+  p9_writer_t entries;
+  while (true) {
+    long    position = telldir(fid._dir);
+    dirent *entry    = readdir(fid._dir);
+    if (!entry) break;
+    std::string name = entry->d_name;
+    // qid[13] offset[8] type[1] name[s]
+    if (entries._data.size() + 24 + name.size() > count) {
+      seekdir(fid._dir, position);
+      break;
+    }
+    entries.put<uint8_t>(entry->d_type == DT_DIR   ? p9_qid_dir
+                         : entry->d_type == DT_LNK ? p9_qid_symlink
+                                                   : 0);
+    entries.put<uint32_t>(0);
+    entries.put<uint64_t>(entry->d_ino);
+    entries.put<uint64_t>(telldir(fid._dir));
+    entries.put<uint8_t>(entry->d_type);
+    entries.put_string(name);
+  }
+  reply.put<uint32_t>(entries._data.size());
+  reply._data.insert(reply._data.end(), entries._data.begin(),
+                     entries._data.end());
+}
+
+void p9_getattr(const p9_fid_t &fid, p9_writer_t &reply) {
+  struct stat st;
+  if (fid._fd >= 0)
+    p9_check(fstat(fid._fd, &st));
+  else
+    st = p9_lstat(fid._path);
+  reply.put<uint64_t>(p9_getattr_basic);
+  reply.put_qid(st);
+  reply.put<uint32_t>(st.st_mode);
+  reply.put<uint32_t>(st.st_uid);
+  reply.put<uint32_t>(st.st_gid);
+  reply.put<uint64_t>(st.st_nlink);
+  reply.put<uint64_t>(st.st_rdev);
+  reply.put<uint64_t>(st.st_size);
+  reply.put<uint64_t>(st.st_blksize);
+  reply.put<uint64_t>(st.st_blocks);
+  reply.put<uint64_t>(st.st_atim.tv_sec);
+  reply.put<uint64_t>(st.st_atim.tv_nsec);
+  reply.put<uint64_t>(st.st_mtim.tv_sec);
+  reply.put<uint64_t>(st.st_mtim.tv_nsec);
+  reply.put<uint64_t>(st.st_ctim.tv_sec);
+  reply.put<uint64_t>(st.st_ctim.tv_nsec);
+  for (int i = 0; i < 4; i++) reply.put<uint64_t>(0);  // btime, gen, version
+}
+
+void p9_setattr(const p9_fid_t &fid, p9_reader_t &request) {
+  uint32_t    valid      = request.get<uint32_t>();
+  uint32_t    mode       = request.get<uint32_t>();
+  uint32_t    uid        = request.get<uint32_t>();
+  uint32_t    gid        = request.get<uint32_t>();
+  uint64_t    size       = request.get<uint64_t>();
+  uint64_t    atime_sec  = request.get<uint64_t>();
+  uint64_t    atime_nsec = request.get<uint64_t>();
+  uint64_t    mtime_sec  = request.get<uint64_t>();
+  uint64_t    mtime_nsec = request.get<uint64_t>();
+  p9_at_t     at         = p9_at(fid._path);
+  if (valid & 0x1) {
+    // chmod has no nofollow form, it goes through a handle on the entry
+    p9_fd_t target{p9_open(fid._path, O_PATH | O_NOFOLLOW | O_CLOEXEC)};
+    std::string proc = "/proc/self/fd/" + std::to_string(target._fd);
+    p9_check(chmod(proc.c_str(), mode & 07777));
+  }
+  if (valid & 0x6)
+    p9_check(fchownat(at._dir._fd, at._name.c_str(),
+                      (valid & 0x2) ? uid : -1, (valid & 0x4) ? gid : -1,
+                      AT_SYMLINK_NOFOLLOW));
+  if (valid & 0x8) {
+    p9_fd_t target{p9_open(fid._path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)};
+    p9_check(ftruncate(target._fd, size));
+  }
+  if (valid & 0x30) {
+    // *_SET means the time given, otherwise now
+    timespec times[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+    if (valid & 0x10)
+      times[0] = (valid & 0x80) ? timespec{static_cast<time_t>(atime_sec),
+                                           static_cast<long>(atime_nsec)}
+                                : timespec{0, UTIME_NOW};
+    if (valid & 0x20)
+      times[1] = (valid & 0x100) ? timespec{static_cast<time_t>(mtime_sec),
+                                            static_cast<long>(mtime_nsec)}
+                                 : timespec{0, UTIME_NOW};
+    p9_check(utimensat(at._dir._fd, at._name.c_str(), times,
+                       AT_SYMLINK_NOFOLLOW));
+  }
+}
+
+// handles one T-message, the R-message is built in reply after its header
+void p9_dispatch(uint8_t type, p9_reader_t &request, p9_writer_t &reply) {
+  switch (type) {
+    case p9_tversion: {
+      uint32_t    msize   = request.get<uint32_t>();
+      std::string version = request.get_string();
+      // reads and readdirs are sized from msize less the reply header, a
+      // reply may not grow msize so a client asking for too little fails
+      if (msize < p9_min_msize) throw p9_error_t{EINVAL};
+      for (auto &[_, fid] : virtio_9p_server._fids) p9_close_fid(fid);
+      virtio_9p_server._fids.clear();
+      virtio_9p_server._msize = std::min(msize, p9_max_msize);
+      reply.put<uint32_t>(virtio_9p_server._msize);
+      reply.put_string(version.starts_with("9P2000.L") ? "9P2000.L"
+                                                       : "unknown");
+      return;
+    }
+    case p9_tattach: {
+      uint32_t fid = request.get<uint32_t>();
+      p9_clunk(fid);
+      virtio_9p_server._fids[fid] = {};
+      reply.put_qid(p9_lstat(""));
+      return;
+    }
+    case p9_twalk: {
+      uint32_t    fid     = request.get<uint32_t>();
+      uint32_t    newfid  = request.get<uint32_t>();
+      uint16_t    nwname  = request.get<uint16_t>();
+      std::string path    = p9_get_fid(fid)._path;
+      p9_writer_t qids;
+      uint16_t    nwqid   = 0;
+      for (; nwqid < nwname; nwqid++) {
+        std::string name = request.get_string();
+        std::string next = path;
+        if (name == "..") {
+          auto slash = path.rfind('/');
+          next       = slash == std::string::npos ? "" : path.substr(0, slash);
+        } else if (name != ".") {
+          next = p9_child_path(path, name);
+        }
+        struct stat st;
+        try {
+          st = p9_lstat(next);
+        } catch (const p9_error_t &) {
+          if (nwqid == 0) throw;
+          break;
+        }
+        qids.put_qid(st);
+        path = next;
+      }
+      // newfid only exists once every name was walked
+      if (nwqid == nwname) {
+        if (newfid != fid) p9_clunk(newfid);
+        p9_fid_t &target = virtio_9p_server._fids[newfid];
+        if (newfid == fid) p9_close_fid(target);
+        target._path = path;
+      }
+      reply.put<uint16_t>(nwqid);
+      reply._data.insert(reply._data.end(), qids._data.begin(),
+                         qids._data.end());
+      return;
+    }
+    case p9_tclunk: {
+      uint32_t fid = request.get<uint32_t>();
+      p9_get_fid(fid);
+      p9_clunk(fid);
+      return;
+    }
+    case p9_tflush: return;
+    case p9_tgetattr: {
+      p9_getattr(p9_get_fid(request.get<uint32_t>()), reply);
+      return;
+    }
+    case p9_tsetattr: {
+      p9_setattr(p9_get_fid(request.get<uint32_t>()), request);
+      return;
+    }
+    case p9_tstatfs: {
+      struct statvfs st;
+      p9_get_fid(request.get<uint32_t>());
+      p9_check(fstatvfs(virtio_9p_server._root_fd, &st));
+      reply.put<uint32_t>(0x01021997);  // V9FS_MAGIC
+      reply.put<uint32_t>(st.f_bsize);
+      reply.put<uint64_t>(st.f_blocks);
+      reply.put<uint64_t>(st.f_bfree);
+      reply.put<uint64_t>(st.f_bavail);
+      reply.put<uint64_t>(st.f_files);
+      reply.put<uint64_t>(st.f_ffree);
+      reply.put<uint64_t>(st.f_fsid);
+      reply.put<uint32_t>(st.f_namemax);
+      return;
+    }
+    case p9_tlopen: {
+      p9_fid_t &fid   = p9_get_fid(request.get<uint32_t>());
+      uint32_t  flags = request.get<uint32_t>();
+      p9_close_fid(fid);
+      fid._fd = p9_open(fid._path, p9_open_flags(flags) & ~(O_CREAT | O_EXCL));
+      struct stat st;
+      p9_check(fstat(fid._fd, &st));
+      reply.put_qid(st);
+      reply.put<uint32_t>(0);  // iounit, let the client use msize
+      return;
+    }
+    case p9_tlcreate: {
+      p9_fid_t   &fid   = p9_get_fid(request.get<uint32_t>());
+      std::string name  = request.get_string();
+      uint32_t    flags = request.get<uint32_t>();
+      uint32_t    mode  = request.get<uint32_t>();
+      std::string path  = p9_child_path(fid._path, name);
+      int fd = p9_open(path, p9_open_flags(flags) | O_CREAT, mode & 07777);
+      p9_close_fid(fid);
+      fid._path = path;
+      fid._fd   = fd;
+      struct stat st;
+      p9_check(fstat(fd, &st));
+      reply.put_qid(st);
+      reply.put<uint32_t>(0);
+      return;
+    }
+    case p9_tread: {
+      p9_fid_t &fid    = p9_get_fid(request.get<uint32_t>());
+      uint64_t  offset = request.get<uint64_t>();
+      uint32_t  count  = std::min(request.get<uint32_t>(),
+                                  virtio_9p_server._msize - p9_header_size - 4);
+      if (fid._fd < 0) throw p9_error_t{EBADF};
+      uint64_t start = reply._data.size();
+      reply.put<uint32_t>(0);
+      reply._data.resize(start + 4 + count);
+      ssize_t result =
+          p9_check(pread(fid._fd, reply._data.data() + start + 4, count,
+                         offset));
+      reply._data.resize(start + 4 + result);
+      uint32_t length = result;
+      std::memcpy(reply._data.data() + start, &length, sizeof(length));
+      return;
+    }
+    case p9_twrite: {
+      p9_fid_t &fid    = p9_get_fid(request.get<uint32_t>());
+      uint64_t  offset = request.get<uint64_t>();
+      uint32_t  count  = request.get<uint32_t>();
+      if (fid._fd < 0) throw p9_error_t{EBADF};
+      if (request._pos + count > request._size) throw p9_error_t{EPROTO};
+      ssize_t result = p9_check(
+          pwrite(fid._fd, request._data + request._pos, count, offset));
+      reply.put<uint32_t>(result);
+      return;
+    }
+    case p9_treaddir: {
+      p9_fid_t &fid    = p9_get_fid(request.get<uint32_t>());
+      uint64_t  offset = request.get<uint64_t>();
+      uint32_t  count  = std::min(request.get<uint32_t>(),
+                                  virtio_9p_server._msize - p9_header_size - 4);
+      p9_readdir(fid, offset, count, reply);
+      return;
+    }
+    case p9_tfsync: {
+      p9_fid_t &fid = p9_get_fid(request.get<uint32_t>());
+      if (fid._fd >= 0) p9_check(fsync(fid._fd));
+      return;
+    }
+    case p9_tmkdir: {
+      p9_fid_t   &dir  = p9_get_fid(request.get<uint32_t>());
+      std::string path = p9_child_path(dir._path, request.get_string());
+      uint32_t    mode = request.get<uint32_t>();
+      p9_at_t     at   = p9_at(path);
+      p9_check(mkdirat(at._dir._fd, at._name.c_str(), mode & 07777));
+      reply.put_qid(p9_lstat(path));
+      return;
+    }
+    case p9_tsymlink: {
+      p9_fid_t   &dir    = p9_get_fid(request.get<uint32_t>());
+      std::string path   = p9_child_path(dir._path, request.get_string());
+      std::string target = request.get_string();
+      p9_at_t     at     = p9_at(path);
+      p9_check(symlinkat(target.c_str(), at._dir._fd, at._name.c_str()));
+      reply.put_qid(p9_lstat(path));
+      return;
+    }
+    case p9_tmknod: {
+      p9_fid_t   &dir   = p9_get_fid(request.get<uint32_t>());
+      std::string path  = p9_child_path(dir._path, request.get_string());
+      uint32_t    mode  = request.get<uint32_t>();
+      uint32_t    major = request.get<uint32_t>();
+      uint32_t    minor = request.get<uint32_t>();
+      // a device node would give the guest whatever host device it names
+      if (S_ISCHR(mode) || S_ISBLK(mode)) throw p9_error_t{EPERM};
+      p9_at_t at = p9_at(path);
+      p9_check(mknodat(at._dir._fd, at._name.c_str(), mode,
+                       makedev(major, minor)));
+      reply.put_qid(p9_lstat(path));
+      return;
+    }
+    case p9_treadlink: {
+      p9_fid_t &fid = p9_get_fid(request.get<uint32_t>());
+      p9_at_t   at     = p9_at(fid._path);
+      char      target[PATH_MAX];
+      ssize_t   length = p9_check(readlinkat(at._dir._fd, at._name.c_str(),
+                                             target, sizeof(target)));
+      reply.put_string(std::string(target, length));
+      return;
+    }
+    case p9_tlink: {
+      p9_fid_t   &dir  = p9_get_fid(request.get<uint32_t>());
+      p9_fid_t   &fid  = p9_get_fid(request.get<uint32_t>());
+      std::string path = p9_child_path(dir._path, request.get_string());
+      p9_at_t     from = p9_at(fid._path);
+      p9_at_t     to   = p9_at(path);
+      p9_check(linkat(from._dir._fd, from._name.c_str(), to._dir._fd,
+                      to._name.c_str(), 0));
+      return;
+    }
+    case p9_trename: {
+      p9_fid_t   &fid  = p9_get_fid(request.get<uint32_t>());
+      p9_fid_t   &dir  = p9_get_fid(request.get<uint32_t>());
+      std::string path = p9_child_path(dir._path, request.get_string());
+      p9_at_t     from = p9_at(fid._path);
+      p9_at_t     to   = p9_at(path);
+      p9_check(renameat(from._dir._fd, from._name.c_str(), to._dir._fd,
+                        to._name.c_str()));
+      fid._path = path;
+      return;
+    }
+    case p9_trenameat: {
+      p9_fid_t   &old_dir  = p9_get_fid(request.get<uint32_t>());
+      std::string old_path = p9_child_path(old_dir._path, request.get_string());
+      p9_fid_t   &new_dir  = p9_get_fid(request.get<uint32_t>());
+      std::string new_path = p9_child_path(new_dir._path, request.get_string());
+      p9_at_t     from     = p9_at(old_path);
+      p9_at_t     to       = p9_at(new_path);
+      p9_check(renameat(from._dir._fd, from._name.c_str(), to._dir._fd,
+                        to._name.c_str()));
+      return;
+    }
+    case p9_tunlinkat: {
+      p9_fid_t   &dir   = p9_get_fid(request.get<uint32_t>());
+      std::string path  = p9_child_path(dir._path, request.get_string());
+      uint32_t    flags = request.get<uint32_t>();
+      p9_at_t     at    = p9_at(path);
+      p9_check(unlinkat(at._dir._fd, at._name.c_str(), flags & AT_REMOVEDIR));
+      return;
+    }
+    case p9_tlock: {
+      reply.put<uint8_t>(0);  // success, locks are local to the guest
+      return;
+    }
+    case p9_tgetlock: {
+      request.get<uint32_t>();
+      request.get<uint8_t>();
+      uint64_t    start     = request.get<uint64_t>();
+      uint64_t    length    = request.get<uint64_t>();
+      uint32_t    proc_id   = request.get<uint32_t>();
+      std::string client_id = request.get_string();
+      reply.put<uint8_t>(F_UNLCK);
+      reply.put<uint64_t>(start);
+      reply.put<uint64_t>(length);
+      reply.put<uint32_t>(proc_id);
+      reply.put_string(client_id);
+      return;
+    }
+    case p9_txattrwalk: throw p9_error_t{EOPNOTSUPP};
+  }
+  throw p9_error_t{EOPNOTSUPP};
+}
+
+// returns the length of the R-message written to the chain
+uint32_t virtio_9p_request(const virtq_chain_t &chain) {
+  std::vector<uint8_t> &request = virtio_9p_server._request;
+  request.resize(std::min<uint64_t>(virtq_size(chain._readable),
+                                    p9_max_msize));
+  virtq_read(chain._readable, 0, request.data(), request.size());
+  if (request.size() < p9_header_size) return 0;
+  uint8_t  type = request[4];
+  uint16_t tag;
+  std::memcpy(&tag, request.data() + 5, sizeof(tag));
+
+  p9_reader_t reader{._data = request.data(), ._size = request.size()};
+  p9_writer_t reply;
+  reply._data.resize(p9_header_size);
+  uint8_t reply_type = type + 1;
+  try {
+    p9_dispatch(type, reader, reply);
+  } catch (const p9_error_t &error) {
+    reply._data.resize(p9_header_size);
+    reply.put<uint32_t>(error._errno);
+    reply_type = p9_rlerror;
+  }
+  uint32_t size = reply._data.size();
+  std::memcpy(reply._data.data(), &size, sizeof(size));
+  reply._data[4] = reply_type;
+  std::memcpy(reply._data.data() + 5, &tag, sizeof(tag));
+  return virtq_write(chain._writable, 0, reply._data.data(), size);
+}
+
+static virtio_device_t virtio_9p{
+    ._mmio_start      = virtio_9p_mmio_start,
+    ._device_id       = 9,
+    ._irq             = virtio_irq_base + 2,
+    ._num_queues      = 1,
+    ._device_features = virtio_f_version_1 | virtio_9p_f_mount_tag,
+    ._notify          = [](virtio_device_t &, uint32_t) {
+      virtio_9p_server._kick.fetch_add(1, std::memory_order_release);
+      virtio_9p_server._kick.notify_one();
+    }};
+
+// serves every queued request
+void virtio_9p_process() {
+  virtq_chain_t chain;
+  bool          completed = false;
+  {
+    std::lock_guard lock{virtio_9p._lock};
+    virtqueue_t    &queue = virtio_9p._regs._queues[0];
+    while (virtq_pop(queue, chain)) {
+      virtq_push(queue, chain._head, virtio_9p_request(chain));
+      completed = true;
+    }
+  }
+  if (completed) virtio_raise_interrupt(virtio_9p);
+}
+
+void virtio_9p_worker() {
+  while (true) {
+    uint32_t seen = virtio_9p_server._kick.load(std::memory_order_acquire);
+    virtio_9p_process();
+    virtio_9p_server._kick.wait(seen, std::memory_order_acquire);
+  }
+}
+
+void open_virtio_9p(const std::string &root, const std::string &tag) {
+  struct stat st;
+  if (stat(root.c_str(), &st) || !S_ISDIR(st.st_mode))
+    throw std::runtime_error("Shared path is not a directory: " + root);
+  if (tag.empty() || tag.size() > 128)
+    throw std::runtime_error("Mount tag must be 1 to 128 bytes: " + tag);
+  virtio_9p_server._root    = root;
+  virtio_9p_server._root_fd =
+      open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (virtio_9p_server._root_fd < 0)
+    throw std::runtime_error("Failed to open shared path: " + root);
+  try {
+    p9_fd_t probe{p9_open("", O_PATH | O_DIRECTORY | O_CLOEXEC)};
+  } catch (const p9_error_t &) {
+    throw std::runtime_error("Sharing a directory needs openat2 (linux 5.6)");
+  }
+  virtio_9p_server._tag = tag;
+  // struct virtio_9p_config, tag length and the tag without a terminator
+  uint16_t tag_length = tag.size();
+  std::memcpy(virtio_9p._config, &tag_length, sizeof(tag_length));
+  std::memcpy(virtio_9p._config + 2, tag.data(), tag.size());
+  virtio_9p._config_size = 2 + tag.size();
+}
+
+constexpr dawn::mmio_handler_t virtio_9p_handler{
+    ._start  = virtio_9p_mmio_start,
+    ._stop   = virtio_9p_mmio_start + virtio_mmio_size,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      return virtio_mmio_load(virtio_9p, addr);
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          virtio_mmio_store(virtio_9p, addr, value);
+        }};
+
+// shared memory window onto a host file (eg under /dev/shm) for bulk data
+// between host tools and the guest, without going through the console.
+// the file starts with a control page holding two doorbell counters, the
+// rest appears at shmem_mmio_start. the guest rings the host by writing
+// register 0x08, which bumps _guest_doorbell and futex wakes it. a host tool
+// rings the guest by bumping _host_doorbell and futex waking it, which
+// raises plic source shmem_irq until the guest writes 1 to register 0x18.
+// registers: 0x00 data size, 0x08 doorbell, 0x10 host doorbell count,
+// 0x18 interrupt status. with --ram-backing=thp the data is the file mapped
+// over the top of guest ram (see map_shmem_in_ram), so guest accesses run at
+// ram speed inside dawn. otherwise it is an mmio window, a handler call and a
+// memcpy per access
+constexpr uint64_t shmem_regs_mmio_start = 0x11200000;
+constexpr uint64_t shmem_regs_mmio_stop  = 0x11201000;
+constexpr uint64_t shmem_mmio_start      = 0x40000000;
+constexpr uint64_t shmem_max_size = framebuffer_mmio_start - shmem_mmio_start;
+constexpr uint64_t shmem_control_size = 4096;
+constexpr uint32_t shmem_irq          = 11;
+
+struct shmem_control_t {
+  uint32_t _guest_doorbell;  // rings of the guest, host tools wait on this
+  uint32_t _host_doorbell;   // rings of host tools, dem waits on this
+};
+
+static shmem_control_t      *shmem_control = nullptr;
+static uint8_t              *shmem_data    = nullptr;
+static uint64_t              shmem_size    = 0;
+static uint64_t              shmem_addr    = shmem_mmio_start;  // guest
+static bool                  shmem_in_ram  = false;
+static std::atomic<uint32_t> shmem_status{0};
+
+int futex(uint32_t *word, int op, uint32_t value) {
+  return syscall(SYS_futex, word, op, value, nullptr, nullptr, 0);
+}
+
+void open_shmem(const std::string &path, uint64_t size) {
+  if (!size || size % 4096 || size > shmem_max_size)
+    throw std::runtime_error("Shared memory size must be a multiple of 4K up "
+                             "to " + std::to_string(shmem_max_size >> 20) +
+                             "M");
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) throw std::runtime_error("Failed to open shared memory: " + path);
+  struct stat st;
+  if (fstat(fd, &st) ||
+      (static_cast<uint64_t>(st.st_size) < shmem_control_size + size &&
+       ftruncate(fd, shmem_control_size + size))) {
+    close(fd);
+    throw std::runtime_error("Failed to size shared memory: " + path);
+  }
+  void *data = mmap(nullptr, shmem_control_size + size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    throw std::runtime_error("Failed to map shared memory: " + path);
+  shmem_control = static_cast<shmem_control_t *>(data);
+  shmem_data    = static_cast<uint8_t *>(data) + shmem_control_size;
+  shmem_size    = size;
+}
+
+// turns host doorbell rings into interrupts
+void shmem_doorbell_thread() {
+  std::atomic_ref<uint32_t> host_doorbell{shmem_control->_host_doorbell};
+  uint32_t                  seen = host_doorbell.load();
+  while (true) {
+    futex(&shmem_control->_host_doorbell, FUTEX_WAIT, seen);
+    uint32_t value = host_doorbell.load(std::memory_order_acquire);
+    if (value == seen) continue;
+    seen = value;
+    shmem_status.store(1, std::memory_order_release);
+    raise_irq_async(shmem_irq);
+  }
+}
+
+constexpr dawn::mmio_handler_t shmem_regs_handler{
+    ._start  = shmem_regs_mmio_start,
+    ._stop   = shmem_regs_mmio_stop,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      switch (addr - shmem_regs_mmio_start) {
+        case 0x00: return shmem_size;
+        case 0x10:
+          return std::atomic_ref{shmem_control->_host_doorbell}.load(
+              std::memory_order_acquire);
+        case 0x18: return shmem_status.load(std::memory_order_acquire);
+      }
+      return 0;
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          switch (addr - shmem_regs_mmio_start) {
+            case 0x08:
+              std::atomic_ref{shmem_control->_guest_doorbell}.fetch_add(
+                  1, std::memory_order_release);
+              futex(&shmem_control->_guest_doorbell, FUTEX_WAKE, INT32_MAX);
+              break;
+            case 0x18:
+              if (value & 1) shmem_status.store(0, std::memory_order_release);
+              break;
+          }
+        }};
+
+// accesses straddling the end of the window are cut short instead of
+// touching past the mapping
+constexpr dawn::mmio_handler_t shmem_handler{
+    ._start  = shmem_mmio_start,
+    ._stop   = shmem_mmio_start + shmem_max_size,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      uint64_t offset = addr - shmem_mmio_start;
+      uint64_t value  = 0;
+      if (offset < shmem_size)
+        std::memcpy(&value, shmem_data + offset,
+                    std::min<uint64_t>(8, shmem_size - offset));
+      return value;
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          uint64_t offset = addr - shmem_mmio_start;
+          if (offset < shmem_size)
+            std::memcpy(shmem_data + offset, &value,
+                        std::min<uint64_t>(8, shmem_size - offset));
+        }};
+
+// threads do not survive fork, so device threads start after cloning. with
+// --record or --replay the run loop serves the queues instead
+void start_virtio_threads() {
+  if (!options._record_path.empty() || !options._replay_path.empty()) return;
+  if (virtio_blk_disk._data) std::thread{virtio_blk_worker}.detach();
+  if (!virtio_9p_server._root.empty()) std::thread{virtio_9p_worker}.detach();
+}
+
+// every mmio device sits behind the single handler registered with dawn and
+// is found through a table of 64KiB granules instead of a linear handler
+// list, devices must not share a granule
+constexpr uint64_t mmio_decode_start  = plic_mmio_start;
+constexpr uint64_t mmio_decode_stop   = framebuffer_mmio_stop;
+constexpr uint64_t mmio_granule_shift = 16;
+constexpr uint64_t mmio_granules =
+    ((mmio_decode_stop - mmio_decode_start) >> mmio_granule_shift) + 1;
+static std::vector<dawn::mmio_handler_t> mmio_devices;
+// granule -> index into mmio_devices + 1, 0 when nothing is mapped
+static uint8_t mmio_decode[mmio_granules];
+
+// per device access counts, indexed like mmio_devices
+struct mmio_stats_t {
+  const char *_name;
+  uint64_t    _loads;
+  uint64_t    _stores;
+};
+static std::vector<mmio_stats_t> mmio_stats;
+
+void register_mmio_device(const char                 *name,
+                          const dawn::mmio_handler_t &handler) {
+  if (handler._start < mmio_decode_start || handler._stop > mmio_decode_stop)
+    throw std::runtime_error("mmio device outside of the decode window");
+  mmio_devices.push_back(handler);
+  mmio_stats.push_back({._name = name});
+  for (uint64_t granule = (handler._start - mmio_decode_start) >>
+                          mmio_granule_shift;
+       granule <= (handler._stop - 1 - mmio_decode_start) >> mmio_granule_shift;
+       granule++) {
+    if (mmio_decode[granule])
+      throw std::runtime_error("mmio devices share a granule at " +
+                               to_hex_string(handler._start));
+    mmio_decode[granule] = mmio_devices.size();
+  }
+}
+
+// index into mmio_devices plus one, 0 if nothing is mapped at addr
+inline uint32_t decode_mmio(uint64_t addr) {
+  uint8_t index =
+      mmio_decode[(addr - mmio_decode_start) >> mmio_granule_shift];
+  if (!index) return 0;
+  const dawn::mmio_handler_t &handler = mmio_devices[index - 1];
+  if (addr < handler._start || addr >= handler._stop) return 0;
+  return index;
+}
+
+constexpr dawn::mmio_handler_t mmio_dispatch_handler{
+    ._start  = mmio_decode_start,
+    ._stop   = mmio_decode_stop,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      uint32_t index = decode_mmio(addr);
+      if (!index) return 0;
+      mmio_stats[index - 1]._loads++;
+      mmio_accesses++;
+      return mmio_devices[index - 1]._load64(addr);
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          uint32_t index = decode_mmio(addr);
+          if (!index) return;
+          mmio_stats[index - 1]._stores++;
+          mmio_accesses++;
+          mmio_devices[index - 1]._store64(addr, value);
+        }};
+
+// --capture streams the framebuffer to a file at a fixed rate of guest time,
+// so runs under --icount capture the same frames at any host speed. raw files
+// hold bgra frames back to back and skip frames identical to the last one
+// written. .y4m files are 4:2:0 video any player or ffmpeg reads, they get a
+// frame for every tick of guest time so playback keeps the guest's pace, an
+// unchanged frame repeats the last one without converting it again
+static int                   capture_fd      = -1;
+static bool                  capture_y4m     = false;
+static uint64_t              capture_next_us = 0;  // in guest time
+static std::vector<uint8_t>  capture_last;         // last frame written
+static std::vector<uint8_t>  capture_frame;        // --fb-ram scratch copy
+static std::vector<uint8_t>  capture_yuv;
+static std::atomic<uint64_t> capture_frames{0};
+static std::atomic<uint64_t> capture_skipped{0};  // unchanged raw frames
+
+void open_capture(const std::string &path) {
+  capture_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+  if (capture_fd < 0)
+    throw std::runtime_error("Failed to open capture: " + path);
+  capture_y4m = path.ends_with(".y4m");
+  capture_last.resize(framebuffer_size);
+  if (options._fb_ram) capture_frame.resize(framebuffer_size);
+  if (!capture_y4m) return;
+  std::string header = std::format("YUV4MPEG2 W{} H{} F{}:1 Ip A1:1 C420jpeg\n",
+                                    width, height, options._capture_fps);
+  write_all(capture_fd, reinterpret_cast<const uint8_t *>(header.data()),
+            header.size());
+  capture_yuv.resize(width * height * 3 / 2);
+}
+
+// bt.601 limited range, chroma is the average of each 2x2 block
+void convert_frame_to_yuv420(const uint8_t *bgra, uint8_t *yuv) {
+  uint8_t *y_plane = yuv;
+  uint8_t *u_plane = y_plane + width * height;
+  uint8_t *v_plane = u_plane + (width / 2) * (height / 2);
+  for (uint64_t i = 0; i < width * height; i++) {
+    const uint8_t *p = bgra + i * 4;
+    y_plane[i]       = (66 * p[2] + 129 * p[1] + 25 * p[0] + 128 + 4096) >> 8;
+  }
+  for (uint64_t y = 0; y < height / 2; y++) {
+    for (uint64_t x = 0; x < width / 2; x++) {
+      int32_t r = 0, g = 0, b = 0;
+      for (uint64_t dy = 0; dy < 2; dy++) {
+        for (uint64_t dx = 0; dx < 2; dx++) {
+          const uint8_t *p = bgra + (y * 2 + dy) * stride + (x * 2 + dx) * 4;
+          b += p[0];
+          g += p[1];
+          r += p[2];
+        }
+      }
+      r /= 4;
+      g /= 4;
+      b /= 4;
+      u_plane[y * (width / 2) + x] =
+          (-38 * r - 74 * g + 112 * b + 128 + 32768) >> 8;
+      v_plane[y * (width / 2) + x] =
+          (112 * r - 94 * g - 18 * b + 128 + 32768) >> 8;
+    }
+  }
+}
+
+// called from the run loop, which owns the framebuffer, between batches
+void capture_poll() {
+  if (timer < capture_next_us) return;
+  // every frame time passed since the last poll, on the fps grid
+  uint64_t interval = 1000000 / options._capture_fps;
+  uint64_t ticks    = (timer - capture_next_us) / interval + 1;
+  // the grid starts at the first frame, wherever guest time begins
+  if (!capture_frames.load(std::memory_order_relaxed)) {
+    ticks           = 1;
+    capture_next_us = timer;
+  }
+  capture_next_us += ticks * interval;
+  const uint8_t *frame = framebuffer;
+  // with --fb-ram the host copy is only refreshed for published frames
+  if (options._fb_ram) {
+    machine->memcpy_guest_to_host(capture_frame.data(), framebuffer_addr,
+                                  framebuffer_size);
+    frame = capture_frame.data();
+  }
+  bool unchanged = capture_frames.load(std::memory_order_relaxed) &&
+                   !std::memcmp(frame, capture_last.data(), framebuffer_size);
+  if (!unchanged) std::memcpy(capture_last.data(), frame, framebuffer_size);
+  if (!capture_y4m) {
+    if (unchanged) {
+      capture_skipped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    write_all(capture_fd, frame, framebuffer_size);
+    capture_frames.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (!unchanged) convert_frame_to_yuv420(frame, capture_yuv.data());
+  // frames of guest time that went by between polls repeat this one
+  for (uint64_t i = 0; i < ticks; i++) {
+    write_all(capture_fd, reinterpret_cast<const uint8_t *>("FRAME\n"), 6);
+    write_all(capture_fd, capture_yuv.data(), capture_yuv.size());
+  }
+  capture_frames.fetch_add(ticks, std::memory_order_relaxed);
+}
+
+// frames presented by the x11 thread and the time spent converting and
+// putting them
+static std::atomic<uint64_t> present_frames{0};
+static std::atomic<uint64_t> present_us{0};
+static std::atomic<uint64_t> present_max_us{0};  // since the last stats line
+
+static int               stats_fd      = -1;
+static uint64_t          stats_next_us = 0;
+static std::atomic<bool> stats_requested{false};
+
+void open_stats(const std::string &path) {
+  if (path.starts_with("unix:")) {
+    sockaddr_un addr{.sun_family = AF_UNIX};
+    std::string socket_path = path.substr(5);
+    if (socket_path.size() >= sizeof(addr.sun_path))
+      throw std::runtime_error("Stats socket path too long: " + socket_path);
+    std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+    stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats_fd < 0 ||
+        connect(stats_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)))
+      throw std::runtime_error("Failed to connect stats socket: " +
+                               socket_path);
+    // a collector going away must not kill the guest
+    signal(SIGPIPE, SIG_IGN);
+  } else {
+    stats_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+    if (stats_fd < 0) throw std::runtime_error("Failed to open stats: " + path);
+  }
+}
+
+// counters are cumulative, consumers diff consecutive lines
+void write_stats(uint64_t now_us, uint64_t ips) {
+  std::string line = std::format(
+      "{{\"time_us\":{},\"guest_time_us\":{},\"instructions\":{},"
+      "\"instructions_per_us\":{},\"idle_us\":{},\"idle_waits\":{},"
+      "\"housekeeping_us\":{},\"timer_interrupts\":{},\"plic_claims\":{},"
+      "\"frames\":{},\"present_us\":{},\"present_max_us\":{},"
+      "\"captured_frames\":{},\"capture_skipped\":{},"
+      "\"balloon_released_bytes\":{},\"mmio\":{{",
+      now_us, timer, total_instructions, ips, run_stats._idle_us,
+      run_stats._idle_waits, run_stats._housekeeping_us,
+      run_stats._timer_interrupts, run_stats._plic_claims,
+      present_frames.load(), present_us.load(), present_max_us.exchange(0),
+      capture_frames.load(), capture_skipped.load(),
+      run_stats._balloon_freed);
+  for (uint64_t i = 0; i < mmio_stats.size(); i++)
+    line += std::format("{}\"{}\":{{\"loads\":{},\"stores\":{}}}",
+                        i ? "," : "", mmio_stats[i]._name,
+                        mmio_stats[i]._loads, mmio_stats[i]._stores);
+  line += "}}\n";
+  write_all(stats_fd, reinterpret_cast<const uint8_t *>(line.data()),
+            line.size());
+}
+
+static std::string bootargs =
+    "earlycon=uart8250,mmio," + to_hex_string(uart_mmio_start) + "," +
+    std::to_string(timebase_frequency) + " console=ttyS0";
+constexpr uint64_t offset   = 0x80000000;
+uint64_t           ram_size = 1024 * 1024 * 1024;  // set from --ram
+
+// dawn keeps guest ram to itself and has no way to take backing memory or
+// hand out a host pointer, so its host mapping is found by planting a marker
+// at both ends of guest ram and looking for them in the large anonymous
+// mappings of the process. nullptr if it is not found
+uint8_t *find_guest_ram_host() {
+  uint64_t marker[4];
+  uint64_t saved[2][4];
+  for (uint64_t i = 0; i < 4; i++)
+    marker[i] = 0x64656d2062616c6cull ^ (get_time_now_us() * (i + 1) + i);
+  uint64_t ends[2] = {offset, offset + ram_size - sizeof(marker)};
+  for (uint32_t end = 0; end < 2; end++) {
+    machine->memcpy_guest_to_host(saved[end], ends[end], sizeof(marker));
+    marker[0] ^= end;
+    machine->memcpy_host_to_guest(ends[end], marker, sizeof(marker));
+    marker[0] ^= end;
+  }
+
+  uint8_t      *found = nullptr;
+  std::ifstream maps("/proc/self/maps");
+  std::string   line;
+  while (!found && std::getline(maps, line)) {
+    uint64_t start, stop;
+    char     perms[5];
+    if (sscanf(line.c_str(), "%lx-%lx %4s", &start, &stop, perms) != 3 ||
+        std::string(perms) != "rw-p" || stop - start < ram_size)
+      continue;
+    // allocator headers sit in front of the ram, look through the first page
+    for (uint64_t base = start; base + ram_size <= stop && base < start + 4096;
+         base += 8) {
+      uint8_t *host = reinterpret_cast<uint8_t *>(base);
+      if (std::memcmp(host, marker, sizeof(marker))) continue;
+      marker[0] ^= 1;
+      if (!std::memcmp(host + ram_size - sizeof(marker), marker,
+                       sizeof(marker)))
+        found = host;
+      marker[0] ^= 1;
+      if (found) break;
+    }
+  }
+
+  for (uint32_t end = 0; end < 2; end++)
+    machine->memcpy_host_to_guest(ends[end], saved[end], sizeof(marker));
+  return found;
+}
+
+static uint8_t *guest_ram_host = nullptr;
+// host pages of guest ram mapped from a boot image or snapshot file,
+// [first, last)
+static std::vector<std::pair<uint64_t, uint64_t>> guest_ram_file_pages;
+constexpr uint64_t huge_page_size = 2 * 1024 * 1024;
+
+// fresh lazily committed pages over [first, last) of guest ram, zero on touch
+void map_anonymous_guest_ram(uint64_t first, uint64_t last) {
+  void *mapped = mmap(reinterpret_cast<void *>(first), last - first,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                      -1, 0);
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error("Failed to back guest ram");
+  madvise(mapped, last - first, MADV_HUGEPAGE);
+}
+
+// swaps the whole pages of the still empty guest ram for the --ram-backing
+// the user asked for. thp maps MAP_NORESERVE with transparent huge pages, so
+// untouched ram costs nothing and host side guest accesses take fewer tlb
+// misses. hugetlb maps the huge page aligned middle from the hugetlbfs pool,
+// up front so a short pool fails here and not on a later fault. a partial
+// first or last page (allocator headers) keeps dawn's backing. the mapping
+// only stays guest ram while dawn never moves it, which find_guest_ram_host
+// checks once here
+void back_guest_ram() {
+  if (options._ram_backing == ram_backing_dawn) return;
+  guest_ram_host = find_guest_ram_host();
+  if (!guest_ram_host)
+    throw std::runtime_error(
+        "Guest ram of dawn::machine_t not found, run with --ram-backing=dawn");
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t host      = reinterpret_cast<uint64_t>(guest_ram_host);
+  uint64_t first     = (host + page_size - 1) & ~(page_size - 1);
+  uint64_t last      = (host + ram_size) & ~(page_size - 1);
+  if (first >= last) return;
+  if (options._ram_backing == ram_backing_thp)
+    return map_anonymous_guest_ram(first, last);
+
+  uint64_t huge_first = (first + huge_page_size - 1) & ~(huge_page_size - 1);
+  uint64_t huge_last  = last & ~(huge_page_size - 1);
+  if (huge_first >= huge_last)
+    throw std::runtime_error("--ram-backing=hugetlb needs more guest ram");
+  if (first < huge_first) map_anonymous_guest_ram(first, huge_first);
+  if (huge_last < last) map_anonymous_guest_ram(huge_last, last);
+  void *mapped = mmap(reinterpret_cast<void *>(huge_first),
+                      huge_last - huge_first, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                          (21 << MAP_HUGE_SHIFT) | MAP_FIXED,
+                      -1, 0);
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error(std::format(
+        "Failed to map {} MiB of 2 MiB huge pages, reserve them in "
+        "/proc/sys/vm/nr_hugepages",
+        (huge_last - huge_first) >> 20));
+}
+
+// maps the whole pages of a raw image straight over its place in guest ram,
+// private so guest writes never reach the file, and returns the bytes
+// mapped. 0 when guest ram is dawn's or hugetlb pages, or the image does not
+// start on a host page, the caller copies whatever was not mapped
+uint64_t map_image_in_place(const std::string &path, uint64_t guest_addr,
+                            uint64_t size) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t whole     = size & ~(page_size - 1);
+  if (!guest_ram_host || options._ram_backing != ram_backing_thp || !whole)
+    return 0;
+  uint8_t *host = guest_ram_host + (guest_addr - offset);
+  if (reinterpret_cast<uint64_t>(host) % page_size) return 0;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) throw std::runtime_error("Failed to open file: " + path);
+  void *mapped = mmap(host, whole, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, fd, 0);
+  close(fd);
+  // a failed MAP_FIXED may already have unmapped part of guest ram
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error("Failed to map image into guest ram: " + path);
+  uint64_t first = reinterpret_cast<uint64_t>(host);
+  guest_ram_file_pages.push_back({first, first + whole});
+  return whole;
+}
+
+// maps the shmem data shared over the highest huge page aligned stretch of
+// guest ram below top that holds it, the fdt keeps linux off it
+void map_shmem_in_ram(uint64_t top) {
+  if (shmem_size + huge_page_size > top - offset)
+    throw std::runtime_error("--shmem does not fit in guest ram");
+  uint64_t ram  = reinterpret_cast<uint64_t>(guest_ram_host);
+  uint64_t host = (ram + (top - offset) - shmem_size) & ~(huge_page_size - 1);
+  int      fd   = open(options._shmem_path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error("Failed to open shared memory: " +
+                             options._shmem_path);
+  void *mapped = mmap(reinterpret_cast<void *>(host), shmem_size,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                      shmem_control_size);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error("Failed to map shared memory into guest ram: " +
+                             options._shmem_path);
+  shmem_addr = host - ram + offset;
+}
+
+// part [first, last) of [addr, addr + size) that is the ram mapped shmem
+// window, first >= last when they do not overlap. the window belongs to the
+// file, snapshots neither save nor restore it
+std::pair<uint64_t, uint64_t> shmem_ram_overlap(uint64_t addr, uint64_t size) {
+  if (!shmem_in_ram) return {addr, addr};
+  return {std::max(addr, shmem_addr),
+          std::min(addr + size, shmem_addr + shmem_size)};
+}
+
+// virtio-balloon with free page reporting, pages the guest inflates or
+// reports free are dropped from the host and read back as zeros. it needs
+// --ram-backing=thp, guest ram has to be found to release anything
+constexpr uint64_t virtio_balloon_mmio_start    = virtio_mmio_base + 0x30000;
+constexpr uint64_t virtio_balloon_f_deflate_oom = 1ull << 2;
+constexpr uint64_t virtio_balloon_f_reporting   = 1ull << 5;
+constexpr uint64_t virtio_balloon_pfn_shift     = 12;
+constexpr uint32_t virtio_balloon_inflateq      = 0;
+constexpr uint32_t virtio_balloon_reportingq    = 2;
+
+// drops the whole host pages inside [addr, addr + size) of guest ram
+void virtio_balloon_release(uint64_t addr, uint64_t size) {
+  if (!guest_ram_host || addr < offset || addr - offset >= ram_size) return;
+  size               = std::min(size, offset + ram_size - addr);
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t host  = reinterpret_cast<uint64_t>(guest_ram_host) + addr - offset;
+  uint64_t first = (host + page_size - 1) & ~(page_size - 1);
+  uint64_t last  = (host + size) & ~(page_size - 1);
+  if (first >= last) return;
+  if (madvise(reinterpret_cast<void *>(first), last - first, MADV_DONTNEED))
+    return;
+  run_stats._balloon_freed += last - first;
+  // dropped pages of a boot image or snapshot mapped in place would read back
+  // the file, they get fresh anonymous pages instead
+  for (auto [file_first, file_last] : guest_ram_file_pages) {
+    uint64_t overlap_first = std::max(first, file_first);
+    uint64_t overlap_last  = std::min(last, file_last);
+    if (overlap_first < overlap_last)
+      map_anonymous_guest_ram(overlap_first, overlap_last);
+  }
+}
+
+static virtio_device_t virtio_balloon{
+    ._mmio_start      = virtio_balloon_mmio_start,
+    ._device_id       = 5,
+    ._irq             = virtio_irq_base + 3,
+    ._num_queues      = 3,  // inflate, deflate and reporting
+    ._device_features = virtio_f_version_1 | virtio_balloon_f_deflate_oom |
+                        virtio_balloon_f_reporting,
+    ._config_size     = 8,  // num_pages, target of 0 pages, and actual
+    ._notify =
+        [](virtio_device_t &device, uint32_t queue) {
+          virtqueue_t  &vq = device._regs._queues[queue];
+          virtq_chain_t chain;
+          bool          consumed = false;
+          while (virtq_pop(vq, chain)) {
+            if (queue == virtio_balloon_inflateq) {
+              // 4KiB page frame numbers, whatever the guest page size
+              std::vector<uint32_t> pfns(virtq_size(chain._readable) / 4);
+              virtq_read(chain._readable, 0, pfns.data(), pfns.size() * 4);
+              for (uint32_t pfn : pfns)
+                virtio_balloon_release(
+                    static_cast<uint64_t>(pfn) << virtio_balloon_pfn_shift,
+                    1ull << virtio_balloon_pfn_shift);
+            } else if (queue == virtio_balloon_reportingq) {
+              // each buffer is a free range the device may drop
+              for (const virtq_desc_t &desc : chain._writable)
+                virtio_balloon_release(desc._addr, desc._len);
+            }
+            // deflated pages need nothing, they fault back in on first touch
+            virtq_push(vq, chain._head, 0);
+            consumed = true;
+          }
+          if (consumed) virtio_raise_interrupt(device);
+        },
+    ._config_store =
+        [](virtio_device_t &device, uint64_t offset, uint64_t value) {
+          if (offset == 4) std::memcpy(device._config + 4, &value, 4);
+        }};
+
+constexpr dawn::mmio_handler_t virtio_balloon_handler{
+    ._start  = virtio_balloon_mmio_start,
+    ._stop   = virtio_balloon_mmio_start + virtio_mmio_size,
+    ._load64 = [](uint64_t addr) -> uint64_t {
+      return virtio_mmio_load(virtio_balloon, addr);
+    },
+    ._store64 =
+        [](uint64_t addr, uint64_t value) {
+          virtio_mmio_store(virtio_balloon, addr, value);
+        }};
+
+static std::atomic<bool> should_close{false};
+static std::atomic<bool> x11_closed{true};  // no present thread running
+
+// a8r8g8b8 and the x8r8g8b8 layout of a 24-bit TrueColor visual are byte
+// identical on an LSBFirst image (the server ignores the top byte), so the
+// conversion is a plain vectorized copy unless the server wants MSBFirst
+void convert_framebuffer_rows(XImage *image, uint64_t first_row,
+                              uint64_t num_rows) {
+  for (uint64_t row = first_row; row < first_row + num_rows; row++) {
+    const uint8_t *src = framebuffer_front + row * stride;
+    char          *dst = image->data + row * image->bytes_per_line;
+    if (image->byte_order == LSBFirst) {
+      std::memcpy(dst, src, stride);
+    } else {
+      const uint32_t *src32 = reinterpret_cast<const uint32_t *>(src);
+      uint32_t       *dst32 = reinterpret_cast<uint32_t *>(dst);
+      for (uint64_t i = 0; i < width; i++)
+        dst32[i] = __builtin_bswap32(src32[i]);
+    }
+  }
+}
+
+struct x11_present_buffer_t {
+  XImage         *_image = nullptr;
+  XShmSegmentInfo _shminfo{};
+  // server has not yet sent ShmCompletion for this buffer
+  bool            _busy = false;
+  // rows the guest changed since this buffer was last converted
+  uint64_t        _stale[framebuffer_dirty_words]{};
+};
+
+void x11_framebuffer_thread() {
+  Display *display = XOpenDisplay(nullptr);
+  if (!display) {
+    throw std::runtime_error("Failed to open X11 display");
+  }
+
+  int    screen = DefaultScreen(display);
+  Window root   = RootWindow(display, screen);
+
+  XVisualInfo vinfo;
+  if (!XMatchVisualInfo(display, screen, 24, TrueColor, &vinfo)) {
+    throw std::runtime_error("Failed to find 24-bit visual");
+  }
+
+  XSetWindowAttributes attr;
+  attr.colormap = XCreateColormap(display, root, vinfo.visual, AllocNone);
+  attr.border_pixel     = 0;
+  attr.background_pixel = 0;
+  attr.event_mask = StructureNotifyMask | ExposureMask | KeyPressMask |
+                    KeyReleaseMask | ButtonPressMask | ButtonReleaseMask |
+                    PointerMotionMask | FocusChangeMask;
+
+  Window window = XCreateWindow(
+      display, root, 0, 0, width, height, 0, vinfo.depth, InputOutput,
+      vinfo.visual, CWColormap | CWBorderPixel | CWBackPixel | CWEventMask,
+      &attr);
+
+  XMapWindow(display, window);
+  XStoreName(display, window, "DEM");
+  // held keys repeat as presses only, so they map to evdev repeats
+  XkbSetDetectableAutoRepeat(display, True, nullptr);
+
+  GC gc = DefaultGC(display, screen);
+
+  // double buffered MIT-SHM images, the server reads one while the other is
+  // being converted, falls back to a single XPutImage buffer
+  bool use_shm             = XShmQueryExtension(display);
+  int  shm_completion_type = XShmGetEventBase(display) + ShmCompletion;
+  x11_present_buffer_t buffers[2];
+  uint32_t             num_buffers = use_shm ? 2 : 1;
+  std::vector<uint8_t> image_buffer;
+  if (use_shm) {
+    for (auto &buffer : buffers) {
+      buffer._image =
+          XShmCreateImage(display, vinfo.visual, vinfo.depth, ZPixmap, nullptr,
+                          &buffer._shminfo, width, height);
+      if (!buffer._image)
+        throw std::runtime_error("Failed to create XShmImage");
+      buffer._shminfo.shmid =
+          shmget(IPC_PRIVATE, buffer._image->bytes_per_line * height,
+                 IPC_CREAT | 0600);
+      if (buffer._shminfo.shmid < 0)
+        throw std::runtime_error("Failed to create shm segment");
+      buffer._shminfo.shmaddr = buffer._image->data =
+          reinterpret_cast<char *>(shmat(buffer._shminfo.shmid, nullptr, 0));
+      buffer._shminfo.readOnly = False;
+      if (!XShmAttach(display, &buffer._shminfo))
+        throw std::runtime_error("Failed to attach shm segment");
+    }
+    XSync(display, False);
+    // segments are freed once both sides detach
+    for (auto &buffer : buffers)
+      shmctl(buffer._shminfo.shmid, IPC_RMID, nullptr);
+  } else {
+    image_buffer.resize(width * height * 4);
+    buffers[0]._image = XCreateImage(
+        display, vinfo.visual, vinfo.depth, ZPixmap, 0,
+        reinterpret_cast<char *>(image_buffer.data()), width, height, 32,
+        width * 4);
+    if (!buffers[0]._image) {
+      throw std::runtime_error("Failed to create XImage");
+    }
+  }
+
+  XFlush(display);
+  XSync(display, False);
+
+  std::cout << "X11 window created: " << width << "x" << height
+            << ", depth: " << vinfo.depth << ", stride: " << stride
+            << ", shm: " << use_shm << std::endl;
+
+  bool exposed        = true;
+  bool keys_down[256] = {};
+  auto handle_event   = [&](XEvent &event) {
+    if (event.type == Expose) {
+      exposed = true;
+    } else if (event.type == KeyPress || event.type == KeyRelease) {
+      uint32_t keycode = event.xkey.keycode;
+      if (keycode < 8 || keycode > 255) return;
+      bool press = event.type == KeyPress;
+      virtio_input_queue_event(EV_KEY, keycode - 8,
+                               press ? 1 + keys_down[keycode] : 0);
+      virtio_input_queue_event(EV_SYN, SYN_REPORT, 0);
+      keys_down[keycode] = press;
+    } else if (event.type == FocusOut) {
+      // keys released while another window has focus would stay stuck
+      for (uint32_t keycode = 8; keycode < 256; keycode++) {
+        if (!keys_down[keycode]) continue;
+        virtio_input_queue_event(EV_KEY, keycode - 8, 0);
+        keys_down[keycode] = false;
+      }
+      virtio_input_queue_event(EV_SYN, SYN_REPORT, 0);
+    } else if (event.type == MotionNotify) {
+      virtio_input_queue_event(EV_ABS, ABS_X, event.xmotion.x);
+      virtio_input_queue_event(EV_ABS, ABS_Y, event.xmotion.y);
+      virtio_input_queue_event(EV_SYN, SYN_REPORT, 0);
+    } else if (event.type == ButtonPress || event.type == ButtonRelease) {
+      bool press = event.type == ButtonPress;
+      switch (event.xbutton.button) {
+        case Button1: virtio_input_queue_event(EV_KEY, BTN_LEFT, press); break;
+        case Button2:
+          virtio_input_queue_event(EV_KEY, BTN_MIDDLE, press);
+          break;
+        case Button3: virtio_input_queue_event(EV_KEY, BTN_RIGHT, press); break;
+        case Button4:
+          if (press) virtio_input_queue_event(EV_REL, REL_WHEEL, 1);
+          break;
+        case Button5:
+          if (press) virtio_input_queue_event(EV_REL, REL_WHEEL, -1);
+          break;
+      }
+      virtio_input_queue_event(EV_SYN, SYN_REPORT, 0);
+    } else if (use_shm && event.type == shm_completion_type) {
+      auto &completion = reinterpret_cast<XShmCompletionEvent &>(event);
+      for (auto &buffer : buffers)
+        if (buffer._shminfo.shmseg == completion.shmseg) buffer._busy = false;
+    }
+  };
+
+  const uint64_t frame_duration_us = 33333;
+  uint64_t       next_frame_us     = get_time_now_us();
+  uint32_t       current           = 0;
+
+  while (!should_close) {
+    while (XPending(display)) {
+      XEvent event;
+      XNextEvent(display, &event);
+      handle_event(event);
+    }
+
+    // the back buffer is free before the frame is taken, so the lock is only
+    // held while converting
+    x11_present_buffer_t &back = buffers[current];
+    while (back._busy) {
+      XEvent event;
+      XNextEvent(display, &event);
+      handle_event(event);
+    }
+
+    std::unique_lock front_lock(framebuffer_front_lock);
+    uint64_t         dirty[framebuffer_dirty_words];
+    bool             any_dirty = false;
+    for (uint64_t i = 0; i < framebuffer_dirty_words; i++) {
+      dirty[i]                   = framebuffer_front_dirty[i];
+      framebuffer_front_dirty[i] = 0;
+      if (exposed) dirty[i] = ~0ull;
+      any_dirty |= dirty[i] != 0;
+    }
+    exposed = false;
+
+    if (any_dirty) {
+      uint64_t present_start = get_time_now_us();
+      for (uint32_t b = 0; b < num_buffers; b++)
+        for (uint64_t i = 0; i < framebuffer_dirty_words; i++)
+          buffers[b]._stale[i] |= dirty[i];
+
+      // bring the back buffer up to date, in runs of consecutive stale rows
+      for (uint64_t row = 0; row < height;) {
+        if (!(back._stale[row / 64] & (1ull << (row % 64)))) {
+          row++;
+          continue;
+        }
+        uint64_t run_start = row;
+        while (row < height && (back._stale[row / 64] & (1ull << (row % 64))))
+          row++;
+        convert_framebuffer_rows(back._image, run_start, row - run_start);
+      }
+      front_lock.unlock();
+      uint64_t first_dirty = height, last_dirty = 0;
+      for (uint64_t row = 0; row < height; row++) {
+        if (dirty[row / 64] & (1ull << (row % 64))) {
+          first_dirty = std::min(first_dirty, row);
+          last_dirty  = row;
+        }
+      }
+      std::memset(back._stale, 0, sizeof(back._stale));
+
+      uint64_t band_height = last_dirty - first_dirty + 1;
+      if (use_shm) {
+        XShmPutImage(display, window, gc, back._image, 0, first_dirty, 0,
+                     first_dirty, width, band_height, True);
+        back._busy = true;
+        current    = (current + 1) % num_buffers;
+      } else {
+        XPutImage(display, window, gc, back._image, 0, first_dirty, 0,
+                  first_dirty, width, band_height);
+      }
+      XFlush(display);
+      uint64_t elapsed = get_time_now_us() - present_start;
+      present_frames.fetch_add(1, std::memory_order_relaxed);
+      present_us.fetch_add(elapsed, std::memory_order_relaxed);
+      uint64_t max = present_max_us.load(std::memory_order_relaxed);
+      while (elapsed > max &&
+             !present_max_us.compare_exchange_weak(max, elapsed)) {
+      }
+    }
+    if (front_lock) front_lock.unlock();
+    // the run loop publishes the next frame during the wait below, an idle
+    // guest is woken for it
+    framebuffer_frame_requested.store(true, std::memory_order_relaxed);
+    idle_wake();
+
+    // nothing to do until the next frame, a static screen costs one bitmap
+    // scan per frame. input events wake the wait so they reach the guest
+    // right away instead of at the next frame
+    next_frame_us += frame_duration_us;
+    uint64_t now_us = get_time_now_us();
+    if (next_frame_us <= now_us) {
+      next_frame_us = now_us;
+      continue;
+    }
+    while (now_us < next_frame_us) {
+      while (XPending(display)) {
+        XEvent event;
+        XNextEvent(display, &event);
+        handle_event(event);
+      }
+      pollfd   x11_fd{.fd = ConnectionNumber(display), .events = POLLIN};
+      uint64_t wait_us = next_frame_us - now_us;
+      timespec timeout{.tv_sec  = static_cast<time_t>(wait_us / 1000000),
+                       .tv_nsec = static_cast<long>(wait_us % 1000000) * 1000};
+      ppoll(&x11_fd, 1, &timeout, nullptr);
+      now_us = get_time_now_us();
+    }
+  }
+
+  for (uint32_t b = 0; b < num_buffers; b++) {
+    if (use_shm) {
+      XShmDetach(display, &buffers[b]._shminfo);
+      XDestroyImage(buffers[b]._image);
+      shmdt(buffers[b]._shminfo.shmaddr);
+    } else {
+      // data is owned by image_buffer
+      buffers[b]._image->data = nullptr;
+      XDestroyImage(buffers[b]._image);
+    }
+  }
+  XDestroyWindow(display, window);
+  XCloseDisplay(display);
+  x11_closed = true;
+}
+
+void setup_fdt_root_properties(void *fdt) {
+  if (fdt_setprop_string(fdt, 0, "compatible", "riscv-minimal-nommu"))
+    throw std::runtime_error("failed to set compatible property");
+  if (fdt_setprop_string(fdt, 0, "model", "riscv-minimal-nommu,dawn"))
+    throw std::runtime_error("failed to set model property");
+  if (fdt_setprop_cell(fdt, 0, "#address-cells", 2))
+    throw std::runtime_error("failed to set #address-cells property");
+  if (fdt_setprop_cell(fdt, 0, "#size-cells", 2))
+    throw std::runtime_error("failed to set #size-cells property");
+}
+
+int add_fdt_chosen_node(void *fdt) {
+  int chosen = fdt_add_subnode(fdt, 0, "chosen");
+  if (chosen < 0) throw std::runtime_error("failed to add chosen subnode");
+
+  if (fdt_setprop_string(fdt, chosen, "bootargs", bootargs.c_str()))
+    throw std::runtime_error("failed to set bootargs property");
+  return chosen;
+}
+
+int add_fdt_memory_node(void *fdt, uint64_t ram_size) {
+  int memory =
+      fdt_add_subnode(fdt, 0, ("memory@"s + to_hex_string(offset)).c_str());
+  if (memory < 0) throw std::runtime_error("failed to add memory subnode");
+  if (fdt_setprop_string(fdt, memory, "device_type", "memory"))
+    throw std::runtime_error("failed to set memory device_type property");
+  uint64_t memory_reg[] = {cpu_to_fdt64(offset), cpu_to_fdt64(ram_size)};
+  if (fdt_setprop(fdt, memory, "reg", memory_reg, sizeof(memory_reg)))
+    throw std::runtime_error("failed to set memory reg property");
+  return memory;
+}
+
+int add_fdt_cpus_node(void *fdt) {
+  int cpus = fdt_add_subnode(fdt, 0, "cpus");
+  if (cpus < 0) throw std::runtime_error("failed to add cpus subnode");
+  if (fdt_setprop_cell(fdt, cpus, "#address-cells", 1))
+    throw std::runtime_error("failed to set cpus #address-cells property");
+  if (fdt_setprop_cell(fdt, cpus, "#size-cells", 0))
+    throw std::runtime_error("failed to set cpus #size-cells property");
+  if (fdt_setprop_cell(fdt, cpus, "timebase-frequency", timebase_frequency))
+    throw std::runtime_error("failed to set timebase-frequency property");
+  return cpus;
+}
+
+// dem runs a single hart. dawn::machine_t allocates its own guest ram and
+// keeps its lr/sc reservation to itself, so further harts over the same
+// memory, with atomics that hold between them, need support from dawn first
+int add_fdt_cpu_node(void *fdt, int cpus) {
+  int cpu0 = fdt_add_subnode(fdt, cpus, "cpu@0");
+  if (cpu0 < 0) throw std::runtime_error("failed to add cpu@0 subnode");
+  if (fdt_setprop_string(fdt, cpu0, "device_type", "cpu"))
+    throw std::runtime_error("failed to set cpu device_type property");
+  if (fdt_setprop_cell(fdt, cpu0, "reg", 0))
+    throw std::runtime_error("failed to set cpu reg property");
+  if (fdt_setprop_string(fdt, cpu0, "status", "okay"))
+    throw std::runtime_error("failed to set cpu status property");
+  if (fdt_setprop_string(fdt, cpu0, "compatible", "riscv"))
+    throw std::runtime_error("failed to set cpu compatible property");
+  if (fdt_setprop_string(fdt, cpu0, "riscv,isa", "rv64ima_zicntr_zihpm"))
+    throw std::runtime_error("failed to set cpu riscv,isa property");
+  if (fdt_setprop_string(fdt, cpu0, "mmu-type", "riscv,none"))
+    throw std::runtime_error("failed to set cpu mmu-type property");
+  return cpu0;
+}
+
+int add_fdt_interrupt_controller(void *fdt, int cpu0) {
+  int intc = fdt_add_subnode(fdt, cpu0, "interrupt-controller");
+  if (intc < 0)
+    throw std::runtime_error("failed to add interrupt-controller subnode");
+  if (fdt_setprop_cell(fdt, intc, "#interrupt-cells", 1))
+    throw std::runtime_error(
+        "failed to set interrupt-controller #interrupt-cells property");
+  if (fdt_setprop(fdt, intc, "interrupt-controller", nullptr, 0))
+    throw std::runtime_error("failed to set interrupt-controller property");
+  if (fdt_setprop_string(fdt, intc, "compatible", "riscv,cpu-intc"))
+    throw std::runtime_error(
+        "failed to set interrupt-controller compatible property");
+  uint32_t intc_phandle = 1;
+  if (fdt_setprop_cell(fdt, intc, "phandle", intc_phandle))
+    throw std::runtime_error(
+        "failed to set interrupt-controller phandle property");
+  return intc_phandle;
+}
+
+int add_fdt_soc_node(void *fdt) {
+  int soc = fdt_add_subnode(fdt, 0, "soc");
+  if (soc < 0) throw std::runtime_error("failed to add soc subnode");
+  if (fdt_setprop_cell(fdt, soc, "#address-cells", 2))
+    throw std::runtime_error("failed to set soc #address-cells property");
+  if (fdt_setprop_cell(fdt, soc, "#size-cells", 2))
+    throw std::runtime_error("failed to set soc #size-cells property");
+  if (fdt_setprop_string(fdt, soc, "compatible", "simple-bus"))
+    throw std::runtime_error("failed to set soc compatible property");
+  if (fdt_setprop(fdt, soc, "ranges", NULL, 0))
+    throw std::runtime_error("failed to set soc ranges property");
+  return soc;
+}
+
+int add_fdt_plic_node(void *fdt, int soc, uint32_t intc_phandle) {
+  std::string plic_node_name = "plic@" + std::to_string(plic_mmio_start);
+  int         plic = fdt_add_subnode(fdt, soc, plic_node_name.c_str());
+  if (plic < 0) throw std::runtime_error("failed to add plic subnode");
+  uint64_t plic_reg[] = {cpu_to_fdt64(plic_mmio_start),
+                         cpu_to_fdt64(plic_mmio_stop - plic_mmio_start)};
+  if (fdt_setprop(fdt, plic, "reg", plic_reg, sizeof(plic_reg)))
+    throw std::runtime_error("failed to set plic reg property");
+  if (fdt_setprop_string(fdt, plic, "compatible", "sifive,plic-1.0.0"))
+    throw std::runtime_error("failed to set plic compatible property");
+  if (fdt_appendprop_string(fdt, plic, "compatible", "riscv,plic0"))
+    throw std::runtime_error("failed to set plic compatible property");
+  if (fdt_setprop_cell(fdt, plic, "#interrupt-cells", 1))
+    throw std::runtime_error("failed to set plic #interrupt-cells property");
+  if (fdt_setprop(fdt, plic, "interrupt-controller", nullptr, 0))
+    throw std::runtime_error(
+        "failed to set plic interrupt-controller property");
+  if (fdt_setprop_cell(fdt, plic, "riscv,ndev", 32))
+    throw std::runtime_error("failed to set plic riscv,ndev property");
+  uint32_t plic_intr[] = {cpu_to_fdt32(intc_phandle), cpu_to_fdt32(11)};
+  if (fdt_setprop(fdt, plic, "interrupts-extended", plic_intr,
+                  sizeof(plic_intr)))
+    throw std::runtime_error("failed to set plic interrupts-extended property");
+  uint32_t plic_phandle = 2;
+  if (fdt_setprop_cell(fdt, plic, "phandle", plic_phandle))
+    throw std::runtime_error("failed to set plic phandle property");
+  return plic_phandle;
+}
+
+int add_fdt_uart_node(void *fdt, int soc, uint32_t plic_phandle) {
+  std::string uart_node_name = "uart@" + std::to_string(uart_mmio_start);
+  int         uart = fdt_add_subnode(fdt, soc, uart_node_name.c_str());
+  if (uart < 0) throw std::runtime_error("failed to add uart subnode");
+  uint64_t uart_reg[] = {cpu_to_fdt64(uart_mmio_start),
+                         cpu_to_fdt64(uart_mmio_stop - uart_mmio_start)};
+  if (fdt_setprop_cell(fdt, uart, "clock-frequency", timebase_frequency))
+    throw std::runtime_error("failed to set uart clock-frequency property");
+  if (fdt_setprop(fdt, uart, "reg", uart_reg, sizeof(uart_reg)))
+    throw std::runtime_error("failed to set uart reg property");
+  if (fdt_setprop_string(fdt, uart, "compatible", "ns16550a"))
+    throw std::runtime_error("failed to set uart compatible property");
+  if (fdt_setprop_cell(fdt, uart, "fifo-size", uart_fifo_size))
+    throw std::runtime_error("failed to set uart fifo-size property");
+  if (fdt_setprop_cell(fdt, uart, "interrupts", uart_irq))
+    throw std::runtime_error("failed to set uart interrupts property");
+  if (fdt_setprop_cell(fdt, uart, "interrupt-parent", plic_phandle))
+    throw std::runtime_error("failed to set uart interrupt-parent property");
+  return uart;
+}
+
+int add_fdt_clint_node(void *fdt, int soc, uint32_t intc_phandle) {
+  std::string clint_node_name = "clint@" + std::to_string(clint_mmio_start);
+  int         clint = fdt_add_subnode(fdt, soc, clint_node_name.c_str());
+  if (clint < 0) throw std::runtime_error("failed to add clint subnode");
+  uint64_t clint_reg[] = {cpu_to_fdt64(clint_mmio_start),
+                          cpu_to_fdt64(clint_mmio_stop - clint_mmio_start)};
+  if (fdt_setprop(fdt, clint, "reg", clint_reg, sizeof(clint_reg)))
+    throw std::runtime_error("failed to set clint reg property");
+  if (fdt_setprop_string(fdt, clint, "compatible", "sifive,clint0"))
+    throw std::runtime_error("failed to set clint compatible property");
+  // on the same line as ^
+  if (fdt_appendprop_string(fdt, clint, "compatible", "riscv,clint0"))
+    throw std::runtime_error("failed to append clint compatible property");
+  uint32_t clint_intr[] = {cpu_to_fdt32(intc_phandle), cpu_to_fdt32(3),
+                           cpu_to_fdt32(intc_phandle), cpu_to_fdt32(7)};
+  if (fdt_setprop(fdt, clint, "interrupts-extended", clint_intr,
+                  sizeof(clint_intr)))
+    throw std::runtime_error(
+        "failed to set clint interrupts-extended property");
+  return clint;
+}
+
+int add_fdt_virtio_node(void *fdt, int soc, uint32_t plic_phandle,
+                        const virtio_device_t &device) {
+  std::string virtio_node_name =
+      "virtio_mmio@" + std::to_string(device._mmio_start);
+  int         virtio = fdt_add_subnode(fdt, soc, virtio_node_name.c_str());
+  if (virtio < 0) throw std::runtime_error("failed to add virtio subnode");
+  uint64_t virtio_reg[] = {cpu_to_fdt64(device._mmio_start),
+                           cpu_to_fdt64(virtio_mmio_size)};
+  if (fdt_setprop(fdt, virtio, "reg", virtio_reg, sizeof(virtio_reg)))
+    throw std::runtime_error("failed to set virtio reg property");
+  if (fdt_setprop_string(fdt, virtio, "compatible", "virtio,mmio"))
+    throw std::runtime_error("failed to set virtio compatible property");
+  if (fdt_setprop_cell(fdt, virtio, "interrupts", device._irq))
+    throw std::runtime_error("failed to set virtio interrupts property");
+  if (fdt_setprop_cell(fdt, virtio, "interrupt-parent", plic_phandle))
+    throw std::runtime_error("failed to set virtio interrupt-parent property");
+  return virtio;
+}
+
+// keeps linux from allocating guest ram that the ram backed framebuffer or
+// shmem window live in
+int add_fdt_reserved_memory_node(void *fdt, const std::string &name,
+                                 uint64_t addr, uint64_t size) {
+  int reserved = fdt_subnode_offset(fdt, 0, "reserved-memory");
+  if (reserved < 0) {
+    reserved = fdt_add_subnode(fdt, 0, "reserved-memory");
+    if (reserved < 0)
+      throw std::runtime_error("failed to add reserved-memory subnode");
+    if (fdt_setprop_cell(fdt, reserved, "#address-cells", 2))
+      throw std::runtime_error(
+          "failed to set reserved-memory #address-cells property");
+    if (fdt_setprop_cell(fdt, reserved, "#size-cells", 2))
+      throw std::runtime_error(
+          "failed to set reserved-memory #size-cells property");
+    if (fdt_setprop(fdt, reserved, "ranges", nullptr, 0))
+      throw std::runtime_error(
+          "failed to set reserved-memory ranges property");
+  }
+  std::string region_name = name + "@" + to_hex_string(addr);
+  int         region      = fdt_add_subnode(fdt, reserved, region_name.c_str());
+  if (region < 0)
+    throw std::runtime_error("failed to add reserved " + name + " subnode");
+  uint64_t region_reg[] = {cpu_to_fdt64(addr), cpu_to_fdt64(size)};
+  if (fdt_setprop(fdt, region, "reg", region_reg, sizeof(region_reg)))
+    throw std::runtime_error("failed to set reserved " + name +
+                             " reg property");
+  if (fdt_setprop(fdt, region, "no-map", nullptr, 0))
+    throw std::runtime_error("failed to set reserved " + name +
+                             " no-map property");
+  return reserved;
+}
+
+// the finisher is a syscon register map, poweroff and reboot write their
+// codes to it
+int add_fdt_syscon_nodes(void *fdt, int soc) {
+  std::string syscon_node_name = "test@" + to_hex_string(syscon_mmio_start);
+  int         syscon = fdt_add_subnode(fdt, soc, syscon_node_name.c_str());
+  if (syscon < 0) throw std::runtime_error("failed to add syscon subnode");
+  uint64_t syscon_reg[] = {cpu_to_fdt64(syscon_mmio_start),
+                           cpu_to_fdt64(syscon_mmio_stop - syscon_mmio_start)};
+  if (fdt_setprop(fdt, syscon, "reg", syscon_reg, sizeof(syscon_reg)))
+    throw std::runtime_error("failed to set syscon reg property");
+  if (fdt_setprop_string(fdt, syscon, "compatible", "sifive,test1") ||
+      fdt_appendprop_string(fdt, syscon, "compatible", "sifive,test0") ||
+      fdt_appendprop_string(fdt, syscon, "compatible", "syscon"))
+    throw std::runtime_error("failed to set syscon compatible property");
+  uint32_t syscon_phandle = 3;
+  if (fdt_setprop_cell(fdt, syscon, "phandle", syscon_phandle))
+    throw std::runtime_error("failed to set syscon phandle property");
+
+  const std::pair<const char *, uint32_t> actions[] = {
+      {"poweroff", syscon_pass}, {"reboot", syscon_reset}};
+  for (auto [name, value] : actions) {
+    int node = fdt_add_subnode(fdt, 0, name);
+    if (node < 0)
+      throw std::runtime_error("failed to add "s + name + " subnode");
+    if (fdt_setprop_string(fdt, node, "compatible",
+                           ("syscon-"s + name).c_str()) ||
+        fdt_setprop_cell(fdt, node, "regmap", syscon_phandle) ||
+        fdt_setprop_cell(fdt, node, "offset", 0) ||
+        fdt_setprop_cell(fdt, node, "value", value))
+      throw std::runtime_error("failed to set "s + name + " properties");
+  }
+  return syscon;
+}
+
+// no upstream driver matches, guest userspace maps it through /dev/mem or
+// uio_pdrv_genirq.of_id=dem,shmem
+int add_fdt_shmem_node(void *fdt, int soc, uint32_t plic_phandle) {
+  std::string shmem_node_name = "shmem@" + to_hex_string(shmem_addr);
+  int         shmem = fdt_add_subnode(fdt, soc, shmem_node_name.c_str());
+  if (shmem < 0) throw std::runtime_error("failed to add shmem subnode");
+  uint64_t shmem_reg[] = {cpu_to_fdt64(shmem_addr),
+                          cpu_to_fdt64(shmem_size),
+                          cpu_to_fdt64(shmem_regs_mmio_start),
+                          cpu_to_fdt64(shmem_regs_mmio_stop -
+                                       shmem_regs_mmio_start)};
+  if (fdt_setprop(fdt, shmem, "reg", shmem_reg, sizeof(shmem_reg)))
+    throw std::runtime_error("failed to set shmem reg property");
+  if (fdt_setprop_string(fdt, shmem, "compatible", "dem,shmem"))
+    throw std::runtime_error("failed to set shmem compatible property");
+  if (fdt_setprop_cell(fdt, shmem, "interrupts", shmem_irq))
+    throw std::runtime_error("failed to set shmem interrupts property");
+  if (fdt_setprop_cell(fdt, shmem, "interrupt-parent", plic_phandle))
+    throw std::runtime_error("failed to set shmem interrupt-parent property");
+  return shmem;
+}
+
+int add_fdt_framebuffer_node(void *fdt, int soc) {
+  std::string fb_node_name = "framebuffer@" + std::to_string(framebuffer_addr);
+  int         fb_node  = fdt_add_subnode(fdt, soc, fb_node_name.c_str());
+  uint64_t    fb_reg[] = {cpu_to_fdt64(framebuffer_addr),
+                          cpu_to_fdt64(framebuffer_size)};
+  if (fdt_setprop_string(fdt, fb_node, "compatible", "simple-framebuffer"))
+    throw std::runtime_error("failed to set framebuffer compatible property");
+  if (fdt_setprop(fdt, fb_node, "reg", fb_reg, sizeof(fb_reg)))
+    throw std::runtime_error("failed to set framebuffer reg property");
+  if (fdt_setprop_cell(fdt, fb_node, "width", width))
+    throw std::runtime_error("failed to set framebuffer width property");
+  if (fdt_setprop_cell(fdt, fb_node, "height", height))
+    throw std::runtime_error("failed to set framebuffer height property");
+  if (fdt_setprop_cell(fdt, fb_node, "stride", stride))
+    throw std::runtime_error("failed to set framebuffer stride property");
+  if (fdt_setprop_string(fdt, fb_node, "format", "a8r8g8b8"))
+    throw std::runtime_error("failed to set framebuffer format property");
+  return fb_node;
+}
+
+std::vector<uint8_t> generate_dtb() {
+  std::vector<uint8_t> blob(64 * 1024);
+
+  void *fdt = blob.data();
+  if (fdt_create_empty_tree(fdt, blob.size()))
+    throw std::runtime_error("failed to create empty fdt tree");
+
+  setup_fdt_root_properties(fdt);
+
+  int chosen  = add_fdt_chosen_node(fdt);
+  int memory  = add_fdt_memory_node(fdt, ram_size);
+  int cpus    = add_fdt_cpus_node(fdt);
+  int cpu0    = add_fdt_cpu_node(fdt, cpus);
+  int intc    = add_fdt_interrupt_controller(fdt, cpu0);
+  int soc     = add_fdt_soc_node(fdt);
+  int plic    = add_fdt_plic_node(fdt, soc, intc);
+  int uart    = add_fdt_uart_node(fdt, soc, plic);
+  int clint   = add_fdt_clint_node(fdt, soc, intc);
+  int fb_node = add_fdt_framebuffer_node(fdt, soc);
+  add_fdt_syscon_nodes(fdt, soc);
+  if (options._fb_ram)
+    add_fdt_reserved_memory_node(fdt, "framebuffer", framebuffer_addr,
+                                 framebuffer_size);
+  if (shmem_in_ram)
+    add_fdt_reserved_memory_node(fdt, "shmem", shmem_addr, shmem_size);
+  if (virtio_blk_disk._data) add_fdt_virtio_node(fdt, soc, plic, virtio_blk);
+  if (!options._clones && !options._headless)
+    add_fdt_virtio_node(fdt, soc, plic, virtio_input);
+  if (!virtio_9p_server._root.empty())
+    add_fdt_virtio_node(fdt, soc, plic, virtio_9p);
+  if (shmem_control) add_fdt_shmem_node(fdt, soc, plic);
+  if (options._balloon) add_fdt_virtio_node(fdt, soc, plic, virtio_balloon);
+
+  blob.resize(fdt_totalsize(fdt));
+  return blob;
+}
+
+void patch_dtb(std::vector<uint8_t> &blob, uint64_t initrd_addr,
+               uint64_t initrd_size) {
+  void *fdt    = blob.data();
+  int   chosen = fdt_path_offset(fdt, "/chosen");
+  if (chosen < 0) throw std::runtime_error("failed to get chosen subnode");
+  if (fdt_setprop_cell(fdt, chosen, "linux,initrd-start", initrd_addr))
+    throw std::runtime_error("failed to set linux,initrd-start property");
+  if (fdt_setprop_cell(fdt, chosen, "linux,initrd-end",
+                       initrd_addr + initrd_size))
+    throw std::runtime_error("failed to set linux,initrd-end property");
+}
+
+// guest pc sampling profiler, the run loop records machine->_pc into a lock
+// free open addressing histogram whenever mtime crosses the next sample point
+constexpr uint64_t profile_slots      = 1 << 16;
+constexpr uint64_t profile_max_probes = 64;
+struct profile_slot_t {
+  std::atomic<uint64_t> _pc;  // 0 marks an empty slot, guest pc is never 0
+  std::atomic<uint64_t> _count;
+};
+static bool                  profile_enabled     = false;
+static uint64_t              profile_next_sample = 0;  // in mtime ticks
+static uint64_t              profile_interval    = 0;
+static std::atomic<uint64_t> profile_dropped{0};
+static std::atomic<bool>     profile_report_requested{false};
+static profile_slot_t        profile_histogram[profile_slots];
+
+// only ever called from the run loop thread, so plain load/store is enough.
+// weight is the number of sample points the pc stood for
+void profile_sample(uint64_t pc, uint64_t weight) {
+  uint64_t hash = ((pc >> 1) * 0x9e3779b97f4a7c15ull) >> 48;
+  for (uint64_t probe = 0; probe < profile_max_probes; probe++) {
+    profile_slot_t &slot = profile_histogram[(hash + probe) % profile_slots];
+    uint64_t        key  = slot._pc.load(std::memory_order_relaxed);
+    if (key == pc) {
+      slot._count.store(slot._count.load(std::memory_order_relaxed) + weight,
+                        std::memory_order_relaxed);
+      return;
+    }
+    if (key == 0) {
+      slot._count.store(weight, std::memory_order_relaxed);
+      slot._pc.store(pc, std::memory_order_release);
+      return;
+    }
+  }
+  profile_dropped.fetch_add(weight, std::memory_order_relaxed);
+}
+
+struct profile_symbol_t {
+  uint64_t    _addr;
+  uint64_t    _size;  // 0 when unknown (System.map), extends to the next one
+  std::string _name;
+};
+
+std::vector<profile_symbol_t> load_elf_symbols(const mapped_file_t &file) {
+  std::vector<profile_symbol_t> symbols;
+  // every offset and size comes from the file, none is trusted
+  auto in_file = [&](uint64_t offset, uint64_t size) {
+    return offset <= file.size() && size <= file.size() - offset;
+  };
+  const Elf64_Ehdr *ehdr = reinterpret_cast<const Elf64_Ehdr *>(file.data());
+  if (file.size() < sizeof(Elf64_Ehdr) ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      !in_file(ehdr->e_shoff, ehdr->e_shnum * sizeof(Elf64_Shdr)))
+    throw std::runtime_error("unsupported elf file");
+  const Elf64_Shdr *shdrs =
+      reinterpret_cast<const Elf64_Shdr *>(file.data() + ehdr->e_shoff);
+  for (uint32_t i = 0; i < ehdr->e_shnum; i++) {
+    if (shdrs[i].sh_type != SHT_SYMTAB) continue;
+    if (shdrs[i].sh_link >= ehdr->e_shnum ||
+        !in_file(shdrs[i].sh_offset, shdrs[i].sh_size))
+      throw std::runtime_error("corrupt elf symbol table");
+    const Elf64_Shdr &strtab = shdrs[shdrs[i].sh_link];
+    if (!in_file(strtab.sh_offset, strtab.sh_size))
+      throw std::runtime_error("corrupt elf string table");
+    const Elf64_Sym *syms =
+        reinterpret_cast<const Elf64_Sym *>(file.data() + shdrs[i].sh_offset);
+    const char *names =
+        reinterpret_cast<const char *>(file.data() + strtab.sh_offset);
+    for (uint64_t j = 0; j < shdrs[i].sh_size / sizeof(Elf64_Sym); j++) {
+      // notype symbols are section and local labels, not functions
+      if (ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC ||
+          syms[j].st_shndx == SHN_UNDEF || !syms[j].st_value ||
+          syms[j].st_name >= strtab.sh_size || !names[syms[j].st_name] ||
+          !std::memchr(names + syms[j].st_name, 0,
+                       strtab.sh_size - syms[j].st_name))
+        continue;
+      symbols.push_back({syms[j].st_value, syms[j].st_size,
+                         names + syms[j].st_name});
+    }
+  }
+  return symbols;
+}
+
+std::vector<profile_symbol_t> load_system_map(const std::string &path) {
+  std::vector<profile_symbol_t> symbols;
+  std::ifstream                 file(path);
+  std::string                   line;
+  while (std::getline(file, line)) {
+    uint64_t addr;
+    char     type;
+    char     name[256];
+    if (sscanf(line.c_str(), "%lx %c %255s", &addr, &type, name) != 3) continue;
+    // data symbols are kept too, _end bounds the last text symbol
+    if (type == 'U' || type == 'w') continue;
+    symbols.push_back({addr, 0, name});
+  }
+  return symbols;
+}
+
+std::vector<profile_symbol_t> load_profile_symbols(const std::string &path) {
+  auto                          file = map_file(path);
+  std::vector<profile_symbol_t> symbols;
+  if (file.size() >= SELFMAG && !std::memcmp(file.data(), ELFMAG, SELFMAG))
+    symbols = load_elf_symbols(file);
+  else
+    symbols = load_system_map(path);
+  std::sort(symbols.begin(), symbols.end(),
+            [](const profile_symbol_t &a, const profile_symbol_t &b) {
+              return a._addr < b._addr;
+            });
+  return symbols;
+}
+
+std::string profile_symbolize(const std::vector<profile_symbol_t> &symbols,
+                              uint64_t                             pc) {
+  if (symbols.empty()) return to_hex_string(pc);
+  auto it = std::upper_bound(
+      symbols.begin(), symbols.end(), pc,
+      [](uint64_t pc, const profile_symbol_t &sym) { return pc < sym._addr; });
+  if (it == symbols.begin()) return "[unknown]";
+  const profile_symbol_t &sym = *std::prev(it);
+  // past the end of a sized symbol, or past the last symbol of the image
+  if ((sym._size && pc >= sym._addr + sym._size) ||
+      (!sym._size && it == symbols.end()))
+    return "[unknown]";
+  return sym._name;
+}
+
+void write_profile_report() {
+  std::vector<profile_symbol_t> symbols;
+  if (!options._profile_symbols_path.empty())
+    symbols = load_profile_symbols(options._profile_symbols_path);
+  std::map<std::string, uint64_t> counts;
+  uint64_t                        total = 0;
+  for (profile_slot_t &slot : profile_histogram) {
+    uint64_t pc = slot._pc.load(std::memory_order_acquire);
+    if (!pc) continue;
+    uint64_t count = slot._count.load(std::memory_order_relaxed);
+    counts[profile_symbolize(symbols, pc)] += count;
+    total += count;
+  }
+  std::vector<std::pair<std::string, uint64_t>> sorted(counts.begin(),
+                                                       counts.end());
+  std::sort(sorted.begin(), sorted.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+
+  std::ofstream file(options._profile_path, std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open profile report: " +
+                             options._profile_path);
+  if (options._profile_path.ends_with(".folded")) {
+    for (auto &[name, count] : sorted) file << name << ' ' << count << '\n';
+    return;
+  }
+  file << std::format("# {} samples, {} dropped\n", total,
+                      profile_dropped.load());
+  for (auto &[name, count] : sorted)
+    file << std::format("{:>10} {:>6.2f}% {}\n", count, 100.0 * count / total,
+                        name);
+}
+
+// snapshot file layout:
+//   snapshot_header_t
+//   machine state (_pc, _reg, _csr, _wfi) and device state (plic, clint,
+//   framebuffer), in the order of write_snapshot_state
+//   ram chunks, each a snapshot_chunk_t followed by its data, terminated by a
+//   chunk with _raw_size 0. all zero chunks are skipped. a chunk that
+//   compresses to at most half its size holds zlib data, the others are runs
+//   of raw chunks whose data starts at the next snapshot_raw_align boundary
+//   of the file, which restore maps copy on write straight into guest ram
+constexpr uint64_t snapshot_magic      = 0x33504e534d4544;  // "DEMSNP3"
+constexpr uint64_t snapshot_chunk_size = 64 * 1024;
+constexpr uint64_t snapshot_raw_align  = 4096;
+constexpr uint64_t snapshot_raw_run    = 1ull << 30;
+struct snapshot_header_t {
+  uint64_t _magic;
+  uint64_t _ram_size;
+  uint64_t _offset;
+  uint64_t _icount;
+  uint64_t _state_layout;  // snapshot_state_layout of the writer
+  uint64_t _topology;      // snapshot_topology of the writer
+};
+struct snapshot_chunk_t {
+  uint64_t _guest_addr;
+  uint32_t _raw_size;
+  uint32_t _compressed_size;  // 0 for a raw run
+};
+
+// visits every piece of non ram state in a fixed order, used for both saving
+// and restoring so the two can not drift apart
+template <typename fn_t>
+void visit_snapshot_state(fn_t &&fn) {
+  fn(&machine->_pc, sizeof(machine->_pc));
+  fn(&machine->_reg, sizeof(machine->_reg));
+  fn(&machine->_csr, sizeof(machine->_csr));
+  fn(&machine->_wfi, sizeof(machine->_wfi));
+  fn(&plic, sizeof(plic));
+  fn(&uart, sizeof(uart));
+  fn(&timercmp, sizeof(timercmp));
+  fn(&timer, sizeof(timer));
+  fn(&virtual_instructions, sizeof(virtual_instructions));
+  fn(framebuffer, sizeof(framebuffer));
+  fn(&virtio_blk._regs, sizeof(virtio_blk._regs));
+  fn(&virtio_input._regs, sizeof(virtio_input._regs));
+  fn(&virtio_9p._regs, sizeof(virtio_9p._regs));
+  fn(&virtio_balloon._regs, sizeof(virtio_balloon._regs));
+}
+
+// fnv-1a of the state sizes in visit order, a build whose device state
+// changed shape refuses older snapshots instead of restoring garbage
+uint64_t snapshot_state_layout() {
+  uint64_t hash = 0xcbf29ce484222325;
+  visit_snapshot_state(
+      [&](void *, uint64_t size) { hash = (hash ^ size) * 0x100000001b3; });
+  return hash;
+}
+
+// fnv-1a of the devices the guest was booted with and where they sit. the
+// restored guest has drivers bound to them, so a snapshot only restores
+// under the same --disk, --share, --shmem, --balloon, --fb-ram and input
+// device. paths are left out, a copied disk image restores fine
+uint64_t snapshot_topology() {
+  uint64_t hash = 0xcbf29ce484222325;
+  auto     mix  = [&](uint64_t value) {
+    hash = (hash ^ value) * 0x100000001b3;
+  };
+  mix(virtio_blk_disk._data ? virtio_blk_disk._size : UINT64_MAX);
+  mix(virtio_blk_disk._read_only);
+  mix(!virtio_9p_server._root.empty());
+  for (char c : virtio_9p_server._tag) mix(c);
+  mix(!options._clones && !options._headless);
+  mix(options._balloon);
+  mix(shmem_size);
+  mix(shmem_addr);
+  mix(options._fb_ram ? framebuffer_addr : 0);
+  return hash;
+}
+
+void write_snapshot(const std::string &path) {
+  // virtio backends must not move the queues while they are being saved
+  std::lock_guard blk_lock{virtio_blk._lock};
+  std::lock_guard p9_lock{virtio_9p._lock};
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("Failed to open snapshot: " + path);
+  snapshot_header_t header{._magic        = snapshot_magic,
+                           ._ram_size     = ram_size,
+                           ._offset       = offset,
+                           ._icount       = options._icount,
+                           ._state_layout = snapshot_state_layout(),
+                           ._topology     = snapshot_topology()};
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  visit_snapshot_state([&](void *data, uint64_t size) {
+    file.write(reinterpret_cast<const char *>(data), size);
+  });
+
+  // chunks end where the host address of guest ram is chunk aligned, so raw
+  // runs land on host pages when they are mapped back
+  uint64_t skew =
+      reinterpret_cast<uint64_t>(guest_ram_host) % snapshot_chunk_size;
+  std::vector<uint8_t> raw(snapshot_chunk_size);
+  std::vector<uint8_t> zeros(snapshot_chunk_size);
+  std::vector<uint8_t> compressed(compressBound(snapshot_chunk_size));
+  uint64_t             stored   = 0;
+  uint64_t             mappable = 0;
+  snapshot_chunk_t     run{};  // raw run being written
+  std::streampos       run_at;
+
+  // the header of a raw run is written once its size is known
+  auto end_run = [&]() {
+    if (!run._raw_size) return;
+    std::streampos at = file.tellp();
+    file.seekp(run_at);
+    file.write(reinterpret_cast<const char *>(&run), sizeof(run));
+    file.seekp(at);
+    mappable += run._raw_size;
+    run       = {};
+  };
+  for (uint64_t addr = offset, size; addr < offset + ram_size; addr += size) {
+    size = std::min(snapshot_chunk_size -
+                        (addr - offset + skew) % snapshot_chunk_size,
+                    offset + ram_size - addr);
+    machine->memcpy_guest_to_host(raw.data(), addr, size);
+    auto [shmem_first, shmem_last] = shmem_ram_overlap(addr, size);
+    if (shmem_first < shmem_last)
+      std::memset(raw.data() + (shmem_first - addr), 0,
+                  shmem_last - shmem_first);
+    if (!std::memcmp(raw.data(), zeros.data(), size)) {
+      end_run();
+      continue;
+    }
+    stored++;
+    uLongf compressed_size = compressed.size();
+    if (compress2(compressed.data(), &compressed_size, raw.data(), size, 1) !=
+        Z_OK)
+      throw std::runtime_error("Failed to compress snapshot chunk");
+    if (compressed_size <= size / 2) {
+      end_run();
+      snapshot_chunk_t chunk{._guest_addr      = addr,
+                             ._raw_size        = (uint32_t)size,
+                             ._compressed_size = (uint32_t)compressed_size};
+      file.write(reinterpret_cast<const char *>(&chunk), sizeof(chunk));
+      file.write(reinterpret_cast<const char *>(compressed.data()),
+                 compressed_size);
+      continue;
+    }
+    if (run._raw_size + size > snapshot_raw_run) end_run();
+    if (!run._raw_size) {
+      run    = {._guest_addr = addr};
+      run_at = file.tellp();
+      file.write(reinterpret_cast<const char *>(&run), sizeof(run));
+      uint64_t at = file.tellp();
+      file.write(reinterpret_cast<const char *>(zeros.data()),
+                 (snapshot_raw_align - at % snapshot_raw_align) %
+                     snapshot_raw_align);
+    }
+    file.write(reinterpret_cast<const char *>(raw.data()), size);
+    run._raw_size += size;
+  }
+  end_run();
+  snapshot_chunk_t end{};
+  file.write(reinterpret_cast<const char *>(&end), sizeof(end));
+  if (!file) throw std::runtime_error("Failed to write snapshot: " + path);
+  std::cerr << std::format(
+      "[dem] snapshot written to {}, {} of {} ram chunks stored, {} MiB "
+      "raw\n",
+      path, stored, ram_size / snapshot_chunk_size, mappable >> 20);
+}
+
+// copies a restored piece of ram into the guest, around the shmem window
+void restore_snapshot_ram(uint64_t addr, const uint8_t *data, uint64_t size) {
+  auto [shmem_first, shmem_last] = shmem_ram_overlap(addr, size);
+  if (shmem_first >= shmem_last) shmem_first = shmem_last = addr;
+  machine->memcpy_host_to_guest(addr, data, shmem_first - addr);
+  if (shmem_last < addr + size)
+    machine->memcpy_host_to_guest(shmem_last, data + (shmem_last - addr),
+                                  addr + size - shmem_last);
+}
+
+// maps a raw run of the snapshot private over its place in guest ram, so
+// pages are read in on first touch and shared with the page cache until
+// written. false when guest ram is not thp backed or the run does not line
+// up with host pages, the caller copies it then
+bool map_snapshot_run(int fd, uint64_t file_offset, uint64_t addr,
+                      uint64_t size) {
+  if (!guest_ram_host || options._ram_backing != ram_backing_thp) return false;
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t host = reinterpret_cast<uint64_t>(guest_ram_host) + (addr - offset);
+  auto [shmem_first, shmem_last] = shmem_ram_overlap(addr, size);
+  if (host % page_size || size % page_size || file_offset % page_size ||
+      shmem_first < shmem_last)
+    return false;
+  void *mapped = mmap(reinterpret_cast<void *>(host), size,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                      file_offset);
+  // a failed MAP_FIXED may already have unmapped part of guest ram
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error("Failed to map snapshot into guest ram");
+  guest_ram_file_pages.push_back({host, host + size});
+  return true;
+}
+
+// the snapshot is mapped copy on write. raw runs are mapped straight into
+// guest ram where they line up with host pages, compressed chunks (and raw
+// runs that could not be mapped) are inflated or copied by a few threads,
+// zero chunks are never touched
+void restore_snapshot(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) throw std::runtime_error("Failed to open snapshot: " + path);
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    throw std::runtime_error("Failed to stat snapshot: " + path);
+  }
+  if ((uint64_t)st.st_size < sizeof(snapshot_header_t)) {
+    close(fd);
+    throw std::runtime_error("Truncated snapshot: " + path);
+  }
+  void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(fd);
+    throw std::runtime_error("Failed to map snapshot: " + path);
+  }
+  const uint8_t *begin = reinterpret_cast<const uint8_t *>(mapping);
+  const uint8_t *data  = begin;
+  const uint8_t *end   = data + st.st_size;
+
+  snapshot_header_t header;
+  std::memcpy(&header, data, sizeof(header));
+  data += sizeof(header);
+  if (header._magic != snapshot_magic || header._ram_size != ram_size ||
+      header._offset != offset ||
+      header._state_layout != snapshot_state_layout())
+    throw std::runtime_error("Snapshot does not match this machine: " + path);
+  if (header._topology != snapshot_topology())
+    throw std::runtime_error("Snapshot was taken with other devices: " + path);
+  if (header._icount != options._icount)
+    throw std::runtime_error("Snapshot was taken with --icount=" +
+                             std::to_string(header._icount));
+  visit_snapshot_state([&](void *state, uint64_t size) {
+    if (data + size > end) throw std::runtime_error("Truncated snapshot");
+    std::memcpy(state, data, size);
+    data += size;
+  });
+
+  // pieces of ram left for the threads, a compressed chunk or up to a chunk
+  // of an unmapped raw run
+  struct piece_t {
+    snapshot_chunk_t _chunk;
+    const uint8_t   *_data;
+  };
+  std::vector<piece_t> pieces;
+  uint64_t             chunks = 0;
+  uint64_t             mapped = 0;
+  while (true) {
+    if (data + sizeof(snapshot_chunk_t) > end)
+      throw std::runtime_error("Truncated snapshot");
+    snapshot_chunk_t chunk;
+    std::memcpy(&chunk, data, sizeof(chunk));
+    if (!chunk._raw_size) break;
+    data += sizeof(chunk);
+    uint64_t stored = chunk._compressed_size;
+    if (!stored) {
+      data += (snapshot_raw_align - (data - begin) % snapshot_raw_align) %
+              snapshot_raw_align;
+      stored = chunk._raw_size;
+    }
+    if (stored > static_cast<uint64_t>(end - data))
+      throw std::runtime_error("Truncated snapshot");
+    // chunks land in guest ram, nothing outside of it may be written
+    uint64_t limit =
+        chunk._compressed_size ? snapshot_chunk_size : snapshot_raw_run;
+    if (chunk._guest_addr < offset || chunk._raw_size > limit ||
+        chunk._guest_addr - offset > ram_size - chunk._raw_size)
+      throw std::runtime_error("Corrupt snapshot: " + path);
+    chunks++;
+    if (chunk._compressed_size) {
+      pieces.push_back({chunk, data});
+    } else if (map_snapshot_run(fd, data - begin, chunk._guest_addr,
+                                chunk._raw_size)) {
+      mapped += chunk._raw_size;
+    } else {
+      for (uint64_t done = 0; done < chunk._raw_size;
+           done += snapshot_chunk_size) {
+        uint64_t size = std::min(snapshot_chunk_size, chunk._raw_size - done);
+        pieces.push_back({{._guest_addr = chunk._guest_addr + done,
+                           ._raw_size   = (uint32_t)size},
+                          data + done});
+      }
+    }
+    data += stored;
+  }
+  close(fd);
+
+  std::atomic<uint64_t>    next_piece{0};
+  std::atomic<bool>        failed{false};
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < std::max(std::thread::hardware_concurrency(), 1u);
+       i++) {
+    workers.emplace_back([&]() {
+      std::vector<uint8_t> raw(snapshot_chunk_size);
+      for (uint64_t p; (p = next_piece++) < pieces.size();) {
+        auto [chunk, data] = pieces[p];
+        if (!chunk._compressed_size) {
+          restore_snapshot_ram(chunk._guest_addr, data, chunk._raw_size);
+          continue;
+        }
+        uLongf raw_size = raw.size();
+        if (uncompress(raw.data(), &raw_size, data, chunk._compressed_size) !=
+                Z_OK ||
+            raw_size != chunk._raw_size) {
+          failed = true;
+          return;
+        }
+        restore_snapshot_ram(chunk._guest_addr, raw.data(), raw_size);
+      }
+    });
+  }
+  for (auto &worker : workers) worker.join();
+  munmap(mapping, st.st_size);
+  if (failed) throw std::runtime_error("Corrupt snapshot: " + path);
+  std::cout << std::format("restored snapshot: {}, {} ram chunks, {} MiB "
+                           "mapped\n",
+                           path, chunks, mapped >> 20);
+}
+
+// kernel and initrd may be gzip, xz or zstd compressed, the decompressed size
+// comes from the container so the guest layout is known up front, and the
+// data is decompressed in chunks straight to its guest address
+enum class image_format_t { raw, gzip, xz, zstd };
+constexpr uint64_t image_chunk_size = 1024 * 1024;
+
+struct boot_image_t {
+  mapped_file_t  _file;
+  image_format_t _format = image_format_t::raw;
+  uint64_t       _size   = 0;  // decompressed
+};
+
+image_format_t detect_image_format(const mapped_file_t &file) {
+  const uint8_t *data = file.data();
+  uint64_t       size = file.size();
+  if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+    return image_format_t::gzip;
+  if (size >= 6 && !std::memcmp(data, "\xfd" "7zXZ\0", 6))
+    return image_format_t::xz;
+  if (size >= 4 && !std::memcmp(data, "\x28\xb5\x2f\xfd", 4))
+    return image_format_t::zstd;
+  return image_format_t::raw;
+}
+
+const char *image_format_name(image_format_t format) {
+  switch (format) {
+    case image_format_t::raw: return "raw";
+    case image_format_t::gzip: return "gzip";
+    case image_format_t::xz: return "xz";
+    case image_format_t::zstd: return "zstd";
+  }
+  return "unknown";
+}
+
+uint64_t decompressed_image_size(const boot_image_t &image,
+                                 const std::string  &path) {
+  const uint8_t *data = image._file.data();
+  uint64_t       size = image._file.size();
+  switch (image._format) {
+    case image_format_t::raw: return size;
+    case image_format_t::gzip: {
+      // isize trailer, the size modulo 2^32 of a single member file. a
+      // member is at least a 10 byte header and an 8 byte trailer
+      if (size < 18) throw std::runtime_error("Truncated gzip image: " + path);
+      uint32_t isize;
+      std::memcpy(&isize, data + size - 4, sizeof(isize));
+      return isize;
+    }
+    case image_format_t::xz: {
+#ifdef DEM_HAVE_LZMA
+      // skip stream padding, then read the index the footer points at
+      while (size >= 4 && !std::memcmp(data + size - 4, "\0\0\0\0", 4))
+        size -= 4;
+      lzma_stream_flags flags;
+      if (size < 2 * LZMA_STREAM_HEADER_SIZE ||
+          lzma_stream_footer_decode(
+              &flags, data + size - LZMA_STREAM_HEADER_SIZE) != LZMA_OK ||
+          flags.backward_size > size - 2 * LZMA_STREAM_HEADER_SIZE)
+        throw std::runtime_error("Corrupt xz footer: " + path);
+      lzma_index *index    = nullptr;
+      uint64_t    memlimit = UINT64_MAX;
+      size_t      in_pos   = 0;
+      if (lzma_index_buffer_decode(
+              &index, &memlimit, nullptr,
+              data + size - LZMA_STREAM_HEADER_SIZE - flags.backward_size,
+              &in_pos, flags.backward_size) != LZMA_OK)
+        throw std::runtime_error("Corrupt xz index: " + path);
+      uint64_t result = lzma_index_uncompressed_size(index);
+      lzma_index_end(index, nullptr);
+      return result;
+#else
+      throw std::runtime_error("dem was built without liblzma: " + path);
+#endif
+    }
+    case image_format_t::zstd: {
+#ifdef DEM_HAVE_ZSTD
+      // content size of the first frame, images are a single frame
+      uint64_t result = ZSTD_getFrameContentSize(data, size);
+      if (result == ZSTD_CONTENTSIZE_UNKNOWN ||
+          result == ZSTD_CONTENTSIZE_ERROR)
+        throw std::runtime_error(
+            "zstd image does not record its content size: " + path);
+      return result;
+#else
+      throw std::runtime_error("dem was built without libzstd: " + path);
+#endif
+    }
+  }
+  return size;
+}
+
+boot_image_t open_boot_image(const std::string &path) {
+  boot_image_t image;
+  image._file   = map_file(path);
+  image._format = detect_image_format(image._file);
+  image._size   = decompressed_image_size(image, path);
+  return image;
+}
+
+// decompresses image into guest ram at guest_addr, throws if the stream does
+// not produce exactly image._size bytes
+void load_boot_image(const boot_image_t &image, uint64_t guest_addr,
+                     const std::string &path) {
+  const uint8_t *data = image._file.data();
+  uint64_t       size = image._file.size();
+  if (image._format == image_format_t::raw) {
+    uint64_t mapped = map_image_in_place(path, guest_addr, size);
+    machine->memcpy_host_to_guest(guest_addr + mapped, data + mapped,
+                                  size - mapped);
+    return;
+  }
+  std::vector<uint8_t> chunk(image_chunk_size);
+  uint64_t             written = 0;
+  // copies a decompressed chunk out, refusing to run past the expected size
+  auto flush = [&](uint64_t count) {
+    if (count > image._size - written)
+      throw std::runtime_error("Image larger than its recorded size: " + path);
+    machine->memcpy_host_to_guest(guest_addr + written, chunk.data(), count);
+    written += count;
+  };
+  if (image._format == image_format_t::gzip) {
+    z_stream stream{};
+    if (inflateInit2(&stream, 15 + 16) != Z_OK)
+      throw std::runtime_error("inflateInit2 failed");
+    stream.next_in  = const_cast<uint8_t *>(data);
+    stream.avail_in = size;
+    int ret         = Z_OK;
+    while (ret != Z_STREAM_END) {
+      stream.next_out  = chunk.data();
+      stream.avail_out = chunk.size();
+      ret              = inflate(&stream, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+        inflateEnd(&stream);
+        throw std::runtime_error("Corrupt gzip image: " + path);
+      }
+      flush(chunk.size() - stream.avail_out);
+    }
+    inflateEnd(&stream);
+  } else if (image._format == image_format_t::xz) {
+#ifdef DEM_HAVE_LZMA
+    lzma_stream stream = LZMA_STREAM_INIT;
+    if (lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED) !=
+        LZMA_OK)
+      throw std::runtime_error("lzma_stream_decoder failed");
+    stream.next_in  = data;
+    stream.avail_in = size;
+    lzma_ret ret    = LZMA_OK;
+    while (ret != LZMA_STREAM_END) {
+      stream.next_out  = chunk.data();
+      stream.avail_out = chunk.size();
+      ret              = lzma_code(&stream, LZMA_FINISH);
+      if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+        lzma_end(&stream);
+        throw std::runtime_error("Corrupt xz image: " + path);
+      }
+      flush(chunk.size() - stream.avail_out);
+    }
+    lzma_end(&stream);
+#endif
+  } else if (image._format == image_format_t::zstd) {
+#ifdef DEM_HAVE_ZSTD
+    ZSTD_DStream  *stream = ZSTD_createDStream();
+    ZSTD_inBuffer  in{data, size, 0};
+    size_t         ret    = 1;
+    while (in.pos < in.size || ret) {
+      ZSTD_outBuffer out{chunk.data(), chunk.size(), 0};
+      ret = ZSTD_decompressStream(stream, &out, &in);
+      if (ZSTD_isError(ret) || (!out.pos && in.pos == in.size && ret)) {
+        ZSTD_freeDStream(stream);
+        throw std::runtime_error("Corrupt zstd image: " + path);
+      }
+      flush(out.pos);
+    }
+    ZSTD_freeDStream(stream);
+#endif
+  }
+  if (written != image._size)
+    throw std::runtime_error("Image smaller than its recorded size: " + path);
+}
+
+void load_linux() {
+  // map kernel and initrd, sizes are known before anything is decompressed
+  boot_image_t kernel = open_boot_image(options._kernel_path);
+  boot_image_t initrd;
+  if (!options._initrd_path.empty())
+    initrd = open_boot_image(options._initrd_path);
+
+  // layout: kernel, initrd, dtb. the initrd starts where its host address is
+  // page aligned, so a raw one can be mapped in place
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t skew = reinterpret_cast<uint64_t>(guest_ram_host) % page_size;
+  uint64_t initrd_addr =
+      ((kernel._size + skew + page_size - 1) & ~(page_size - 1)) - skew +
+      offset;
+  uint64_t ram_end = options._fb_ram ? framebuffer_addr : offset + ram_size;
+  if (shmem_in_ram) ram_end = std::min(ram_end, shmem_addr);
+  if (initrd_addr + initrd._size > ram_end)
+    throw std::runtime_error("kernel and initrd do not fit in guest ram");
+
+  // decompress both images in parallel with generating the dtb
+  auto kernel_loaded = std::async(std::launch::async, [&]() {
+    load_boot_image(kernel, offset, options._kernel_path);
+  });
+  auto initrd_loaded = std::async(std::launch::async, [&]() {
+    if (initrd._size)
+      load_boot_image(initrd, initrd_addr, options._initrd_path);
+  });
+
+  // generate dtb
+  auto dtb = generate_dtb();
+  if (initrd._size) patch_dtb(dtb, initrd_addr, initrd._size);
+  uint64_t dtb_addr = initrd_addr + initrd._size;
+  dtb_addr += dtb_addr % 8;
+  if (dtb_addr + dtb.size() > ram_end)
+    throw std::runtime_error("kernel, initrd and dtb do not fit in guest ram");
+
+  kernel_loaded.get();
+  initrd_loaded.get();
+
+  std::cout << "kernel size: " << kernel._size << " ("
+            << image_format_name(kernel._format) << ")\n";
+  std::cout << "kernel loaded at: " << offset << '\n';
+  machine->_pc = offset;
+
+  if (initrd._size) {
+    std::cout << "initrd size: " << initrd._size << " ("
+              << image_format_name(initrd._format) << ")\n";
+    std::cout << "initrd loaded at: " << std::hex << initrd_addr << std::dec
+              << '\n';
+  }
+
+  std::cout << "dtb size: " << dtb.size() << '\n';
+  machine->memcpy_host_to_guest(dtb_addr, dtb.data(), dtb.size());
+  std::cout << "dtb loaded at: " << std::hex << dtb_addr << '\n';
+  machine->_reg[10] = 0;
+  machine->_reg[11] = dtb_addr;
+
+  std::cout << "bootargs: " << bootargs << '\n';
+}
+
+// appends the clone index to per guest output paths
+void suffix_clone_path(std::string &path) {
+  if (!path.empty()) path += "." + std::to_string(clone_index);
+}
+
+// waits for any clone to exit, returns false if it failed
+bool wait_clone(std::map<pid_t, uint32_t> &running) {
+  int   status;
+  pid_t pid = wait(&status);
+  if (pid < 0) throw std::runtime_error("Failed to wait for clone");
+  bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  std::cerr << "[dem] clone " << running[pid] << " exited "
+            << (ok ? "successfully" : "with failure") << '\n';
+  running.erase(pid);
+  return ok;
+}
+
+// forks options._clones copies of the loaded or restored guest, at most
+// options._clone_jobs at a time. the copies share guest ram (and everything
+// else) copy on write, so the base image is paid for once. returns in each
+// clone, the parent exits once all clones have, failing if any failed.
+// processes rather than machines on threads: each dawn::machine_t allocates
+// and owns its guest ram, so in one process every clone would copy the whole
+// base image, and device state lives in globals that fork copies for free
+void run_clones() {
+  std::map<pid_t, uint32_t> running;
+  uint32_t                  failed = 0;
+  for (uint32_t index = 1; index <= options._clones; index++) {
+    if (running.size() == options._clone_jobs) failed += !wait_clone(running);
+    pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error("Failed to fork clone");
+    if (pid == 0) {
+      clone_index = index;
+      suffix_clone_path(options._console_log_path);
+      suffix_clone_path(options._snapshot_path);
+      suffix_clone_path(options._bench_path);
+      suffix_clone_path(options._profile_path);
+      suffix_clone_path(options._capture_path);
+      if (!options._stats_path.starts_with("unix:"))
+        suffix_clone_path(options._stats_path);
+      return;
+    }
+    running[pid] = index;
+  }
+  while (!running.empty()) failed += !wait_clone(running);
+  std::cerr << "[dem] " << options._clones - failed << "/" << options._clones
+            << " clones succeeded\n";
+  exit(failed ? 1 : 0);
+}
+
+// --record logs everything the guest can observe that does not follow from
+// its own execution, so --replay with the same command line runs it again
+// instruction for instruction. every batch of the run loop is logged as its
+// retired instruction count, mtime and wfi cycles, preceded by the host input
+// moved into the guest before it and followed by the device interrupts taken
+// after it. the log is a header and tagged varint records, written by a
+// thread from double buffers
+constexpr uint64_t replay_magic       = 0x31676f6c6d6564;  // "demlog1"
+constexpr uint64_t replay_buffer_size = 1024 * 1024;
+
+enum replay_tag_t : uint8_t {
+  replay_batch = 1,  // retired, zigzag mtime delta
+  replay_batch_wfi,  // as replay_batch, then wfi cycles
+  replay_uart,       // count, bytes
+  replay_input,      // type, code, value
+  replay_irqs,       // plic sources
+};
+
+struct replay_header_t {
+  uint64_t _magic;
+  uint64_t _ram_size;
+  uint64_t _icount;
+};
+
+struct replay_batch_t {
+  uint64_t _retired;
+  uint64_t _timer;
+  uint64_t _wfi_cycles;
+};
+
+struct replay_writer_t {
+  int                  _fd = -1;
+  std::vector<uint8_t> _buffer;   // appended to by the run loop
+  std::vector<uint8_t> _pending;  // being written by replay_writer_thread
+  std::atomic<bool>    _busy{false};
+};
+
+static replay_writer_t replay_writer;
+static mapped_file_t   replay_log;
+static uint64_t        replay_pos   = 0;
+static uint64_t        replay_timer = 0;  // mtime deltas are against this
+
+bool recording() { return replay_writer._fd >= 0; }
+bool replaying() { return replay_log.data() != nullptr; }
+
+void replay_writer_thread() {
+  while (true) {
+    replay_writer._busy.wait(false, std::memory_order_acquire);
+    write_all(replay_writer._fd, replay_writer._pending.data(),
+              replay_writer._pending.size());
+    replay_writer._pending.clear();
+    replay_writer._busy.store(false, std::memory_order_release);
+    replay_writer._busy.notify_one();
+  }
+}
+
+// hands the filled buffer to the writer thread, waiting only if it is still
+// busy with the previous one
+void record_flush() {
+  replay_writer._busy.wait(true, std::memory_order_acquire);
+  std::swap(replay_writer._buffer, replay_writer._pending);
+  replay_writer._busy.store(true, std::memory_order_release);
+  replay_writer._busy.notify_one();
+}
+
+// writes out what is left, called at exit
+void record_finish() {
+  replay_writer._busy.wait(true, std::memory_order_acquire);
+  write_all(replay_writer._fd, replay_writer._buffer.data(),
+            replay_writer._buffer.size());
+  replay_writer._buffer.clear();
+}
+
+void record_varint(uint64_t value) {
+  while (value >= 0x80) {
+    replay_writer._buffer.push_back(value | 0x80);
+    value >>= 7;
+  }
+  replay_writer._buffer.push_back(value);
+}
+
+void open_record(const std::string &path) {
+  replay_writer._fd =
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (replay_writer._fd < 0)
+    throw std::runtime_error("Failed to open record log: " + path);
+  replay_header_t header{._magic    = replay_magic,
+                         ._ram_size = ram_size,
+                         ._icount   = options._icount};
+  write_all(replay_writer._fd, reinterpret_cast<const uint8_t *>(&header),
+            sizeof(header));
+  replay_writer._buffer.reserve(replay_buffer_size + 64);
+  replay_writer._pending.reserve(replay_buffer_size + 64);
+  std::thread{replay_writer_thread}.detach();
+}
+
+// moves host input into the guest side rings, logging what was moved
+void record_host_input() {
+  uint8_t  bytes[256];
+  uint32_t count = 0;
+  while (count < sizeof(bytes) && !uart_rx.full() &&
+         uart_host_rx.pop(bytes[count])) {
+    uart_rx.push(bytes[count]);
+    count++;
+  }
+  if (count) {
+    replay_writer._buffer.push_back(replay_uart);
+    record_varint(count);
+    replay_writer._buffer.insert(replay_writer._buffer.end(), bytes,
+                                 bytes + count);
+  }
+  virtio_input_event_t event;
+  while (!virtio_input_events.full() && virtio_input_host_events.pop(event)) {
+    virtio_input_events.push(event);
+    replay_writer._buffer.push_back(replay_input);
+    record_varint(event._type);
+    record_varint(event._code);
+    record_varint(event._value);
+  }
+}
+
+void record_batch(uint64_t retired, uint64_t wfi_cycles) {
+  int64_t delta = timer - replay_timer;
+  replay_timer  = timer;
+  replay_writer._buffer.push_back(wfi_cycles ? replay_batch_wfi
+                                             : replay_batch);
+  record_varint(retired);
+  record_varint((delta << 1) ^ (delta >> 63));
+  if (wfi_cycles) record_varint(wfi_cycles);
+  if (replay_writer._buffer.size() >= replay_buffer_size) record_flush();
+}
+
+void record_irqs(uint32_t irqs) {
+  replay_writer._buffer.push_back(replay_irqs);
+  record_varint(irqs);
+}
+
+uint64_t replay_varint() {
+  uint64_t value = 0;
+  for (uint32_t shift = 0; replay_pos < replay_log.size(); shift += 7) {
+    uint8_t byte = replay_log.data()[replay_pos++];
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+  throw std::runtime_error("Truncated replay log");
+}
+
+void open_replay(const std::string &path) {
+  replay_log = map_file(path);
+  replay_header_t header;
+  if (replay_log.size() < sizeof(header))
+    throw std::runtime_error("Not a replay log: " + path);
+  std::memcpy(&header, replay_log.data(), sizeof(header));
+  if (header._magic != replay_magic)
+    throw std::runtime_error("Not a replay log: " + path);
+  if (header._ram_size != ram_size || header._icount != options._icount)
+    throw std::runtime_error(
+        "Replay log was recorded with different --ram or --icount: " + path);
+  replay_pos = sizeof(header);
+}
+
+// applies the logged host input up to the next batch and returns it, false
+// at the end of the log
+bool replay_next(replay_batch_t &batch) {
+  while (replay_pos < replay_log.size()) {
+    uint8_t tag = replay_log.data()[replay_pos++];
+    switch (tag) {
+      case replay_uart: {
+        uint64_t count = replay_varint();
+        if (replay_pos + count > replay_log.size())
+          throw std::runtime_error("Truncated replay log");
+        for (uint64_t i = 0; i < count; i++)
+          uart_rx.push(replay_log.data()[replay_pos + i]);
+        replay_pos += count;
+        break;
+      }
+      case replay_input: {
+        virtio_input_event_t event;
+        event._type  = replay_varint();
+        event._code  = replay_varint();
+        event._value = replay_varint();
+        virtio_input_events.push(event);
+        break;
+      }
+      case replay_batch:
+      case replay_batch_wfi: {
+        batch._retired  = replay_varint();
+        uint64_t zigzag = replay_varint();
+        // mtime moves backwards when the guest writes it
+        replay_timer += (zigzag >> 1) ^ -(zigzag & 1);
+        batch._timer      = replay_timer;
+        batch._wfi_cycles = tag == replay_batch_wfi ? replay_varint() : 0;
+        return true;
+      }
+      default:
+        throw std::runtime_error("Corrupt replay log at " +
+                                 std::to_string(replay_pos - 1));
+    }
+  }
+  return false;
+}
+
+// the device interrupts logged after the current batch
+uint32_t replay_irqs_after_batch() {
+  if (replay_pos >= replay_log.size() ||
+      replay_log.data()[replay_pos] != replay_irqs)
+    return 0;
+  replay_pos++;
+  return replay_varint();
+}
+
+// with --record or --replay the virtio backends run between batches instead
+// of on worker threads, so requests complete at reproducible points
+void run_virtio_backends() {
+  if (virtio_blk_disk._data && virtio_blk_disk._kick.exchange(0))
+    virtio_blk_process();
+  if (!virtio_9p_server._root.empty() && virtio_9p_server._kick.exchange(0))
+    virtio_9p_process();
+}
+
+static char   **main_argv    = nullptr;  // executed again on a guest reboot
+static uint64_t run_start_us = 0;
+
+// wall clock time housekeeping is due at even if the guest idles without a
+// timer armed, the next stats line or the end of the --timeout budget.
+// UINT64_MAX if nothing is scheduled
+uint64_t housekeeping_deadline_us() {
+  uint64_t deadline = stats_fd >= 0 ? stats_next_us : UINT64_MAX;
+  if (options._timeout_ms)
+    deadline = std::min(deadline, run_start_us + options._timeout_ms * 1000);
+  return deadline;
+}
+
+void restore_terminal() {
+  struct termios term;
+  tcgetattr(0, &term);
+  term.c_lflag |= ICANON | ECHO;
+  tcsetattr(0, TCSANOW, &term);
+}
+
+// gives the present thread a moment to close its window
+void close_x11() {
+  should_close = true;
+  for (int i = 0; i < 200 && !x11_closed; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+// set by SIGINT, the run loop ends the run at the next batch boundary so the
+// atexit handler never runs while a batch is being logged
+static std::atomic<bool> interrupt_requested{false};
+
+// ends the run on a guest poweroff or a used up budget, the atexit handler
+// still restores the terminal and writes the reports
+[[noreturn]] void finish_run(const std::string &reason, int status) {
+  flush_uart();
+  close_x11();
+  uint64_t elapsed_us = std::max<uint64_t>(get_time_now_us() - run_start_us, 1);
+  std::cerr << std::format(
+      "\n[dem] {}, exit status {}: {} instructions in {:.3f}s ({:.1f} MIPS), "
+      "guest time {:.3f}s\n",
+      reason, status, total_instructions, elapsed_us / 1e6,
+      double(total_instructions) / elapsed_us, timer / 1e6);
+  exit(status);
+}
+
+// a guest reboot starts dem over with the same command line. clones can not
+// be started over on their own, and a new process would truncate the
+// --record log or replay it from the start, so these end instead
+[[noreturn]] void reboot_run() {
+  if (clone_index || recording() || replaying())
+    finish_run("guest rebooted", 0);
+  flush_uart();
+  close_x11();
+  restore_terminal();
+  std::cerr << "\n[dem] guest rebooted, starting over\n";
+  execv("/proc/self/exe", main_argv);
+  throw std::runtime_error("Failed to start over after a guest reboot");
+}
+
+int dem_main(int argc, char **argv) {
+  main_argv = argv;
+  options   = parse_options(argc, argv);
+  ram_size  = options._ram_size;
+
+  register_mmio_device("uart", uart_handler);
+  register_mmio_device("clint", clint_handler);
+  register_mmio_device("plic", plic_handler);
+  register_mmio_device("snapshot", snapshot_handler);
+  register_mmio_device("syscon", syscon_handler);
+  if (options._fb_ram) {
+    // last page aligned framebuffer sized block of guest ram
+    framebuffer_addr = (offset + ram_size - framebuffer_size) & ~0xfffull;
+  } else {
+    register_mmio_device("framebuffer", framebuffer_handler);
+  }
+  if (!options._disk_path.empty()) {
+    open_virtio_blk(options._disk_path, options._disk_read_only);
+    register_mmio_device("virtio_blk", virtio_blk_handler);
+  }
+  if (!options._share_path.empty()) {
+    open_virtio_9p(options._share_path, options._share_tag);
+    register_mmio_device("virtio_9p", virtio_9p_handler);
+  }
+  // input comes from the x11 window, which clones do not have
+  if (!options._clones && !options._headless) {
+    virtio_input_update_config(virtio_input);
+    register_mmio_device("virtio_input", virtio_input_handler);
+  }
+  if (options._balloon)
+    register_mmio_device("virtio_balloon", virtio_balloon_handler);
+  if (!options._shmem_path.empty()) {
+    open_shmem(options._shmem_path, options._shmem_size);
+    register_mmio_device("shmem_regs", shmem_regs_handler);
+    shmem_in_ram = options._ram_backing == ram_backing_thp;
+    dawn::mmio_handler_t window = shmem_handler;
+    window._stop                = shmem_mmio_start + shmem_size;
+    if (!shmem_in_ram) register_mmio_device("shmem", window);
+  }
+  if (!options._append.empty()) bootargs += " " + options._append;
+
+  machine = new dawn::machine_t(ram_size, offset, {mmio_dispatch_handler});
+  back_guest_ram();
+  if (shmem_in_ram)
+    map_shmem_in_ram(options._fb_ram ? framebuffer_addr : offset + ram_size);
+
+  if (options._restore_path.empty())
+    load_linux();
+  else
+    restore_snapshot(options._restore_path);
+
+  if (options._clones) run_clones();
+  init_idle();
+
+  // setup terminal for uart
+  std::atexit([]() {
+    restore_terminal();
+    should_close = true;
+    flush_uart();
+    if (profile_enabled) write_profile_report();
+    if (recording()) record_finish();
+    if (capture_fd >= 0)
+      std::cerr << "[dem] captured " << capture_frames << " frames, skipped "
+                << capture_skipped << " unchanged\n";
+  });
+
+  signal(SIGINT, [](int sig) {
+    interrupt_requested = true;
+    idle_wake();
+  });
+  signal(SIGUSR2, [](int sig) {
+    snapshot_requested = true;
+    idle_wake();
+  });
+  signal(SIGUSR1, [](int sig) {
+    profile_report_requested = true;
+    stats_requested          = true;
+    idle_wake();
+  });
+
+  struct termios term;
+  tcgetattr(0, &term);
+  term.c_lflag &= ~(ICANON | ECHO);
+  tcsetattr(0, TCSANOW, &term);
+
+  start_uart_threads();
+  start_virtio_threads();
+  if (shmem_control) std::thread{shmem_doorbell_thread}.detach();
+  if (!options._stats_path.empty()) open_stats(options._stats_path);
+  if (!options._record_path.empty()) open_record(options._record_path);
+  if (!options._replay_path.empty()) open_replay(options._replay_path);
+
+  if (!options._capture_path.empty()) open_capture(options._capture_path);
+  // clones run headless
+  if (!options._clones && !options._headless) {
+    // the first frame publishes all of a (possibly restored) framebuffer
+    std::fill(std::begin(framebuffer_dirty), std::end(framebuffer_dirty),
+              ~0ull);
+    x11_closed = false;
+    std::thread{x11_framebuffer_thread}.detach();
+  }
+
+  // a restored guest continues from the mtime it was snapshotted at
+  boot_time    = get_time_now_us() - timer;
+  run_start_us = get_time_now_us();
+  uint64_t ips = 1;
+  if (!options._profile_path.empty()) {
+    profile_enabled     = true;
+    profile_interval    = std::max(timebase_frequency / options._profile_hz,
+                                   (uint64_t)1);
+    profile_next_sample = timer;
+  }
+  if (!options._bench_path.empty()) bench_start_phase(get_time_now_us());
+  // instruction count at which mtime reaches timercmp, 0 if no (reachable)
+  // deadline is armed
+  auto icount_deadline = [&]() -> uint64_t {
+    if (!timercmp || timercmp > UINT64_MAX / options._icount) return 0;
+    return timercmp * options._icount;
+  };
+  // idle_wait cut short at housekeeping_deadline_us, true once that is due,
+  // a stats line was asked for or the run was interrupted
+  auto idle_until = [&](uint64_t timeout_us) -> bool {
+    uint64_t now_us = get_time_now_us();
+    uint64_t due_us = housekeeping_deadline_us();
+    if (due_us <= now_us || stats_requested || interrupt_requested)
+      return true;
+    if (due_us != UINT64_MAX && (!timeout_us || timeout_us > due_us - now_us))
+      timeout_us = due_us - now_us;
+    idle_wait(timeout_us);
+    return get_time_now_us() >= due_us || stats_requested ||
+           interrupt_requested;
+  };
+  while (1) {
+    uint64_t instructions_in_loop = 0;
+    uint64_t loop_start           = get_time_now_us();
+    bool     housekeeping_due     = false;
+    while (instructions_in_loop < 1000 && power_request == power_none &&
+           !housekeeping_due) {
+      uint64_t       num_instructions = 10;
+      uint64_t       retired          = 0;
+      uint64_t       wfi_cycles       = 0;
+      replay_batch_t replayed;
+      if (replaying()) {
+        if (!replay_next(replayed)) finish_run("replay log ended", 0);
+      } else if (recording()) {
+        record_host_input();
+      }
+      if (options._icount) {
+        // exactly the number of instructions left until timercmp
+        uint64_t deadline = icount_deadline();
+        if (deadline > virtual_instructions) {
+          num_instructions = std::min(deadline - virtual_instructions,
+                                      (uint64_t)100000);
+        }
+      } else if (timercmp && timercmp > timer) {
+        uint64_t time_left = timercmp - timer;
+        num_instructions   = (time_left * ips) / 1;
+        num_instructions   = std::max(num_instructions, (uint64_t)1);
+        num_instructions   = std::min(num_instructions, (uint64_t)100000);
+      }
+      // stop exactly at the budget so runaway jobs end the same way each time
+      if (options._max_instructions) {
+        if (total_instructions >= options._max_instructions)
+          finish_run("instruction budget used up", 124);
+        num_instructions = std::min(
+            num_instructions, options._max_instructions - total_instructions);
+      }
+      if (replaying()) {
+        // step(0) where the recording idled in wfi, --max-instructions
+        // cuts short the batch the budget runs out in
+        retired = replayed._retired;
+        if (options._max_instructions)
+          retired = std::min(retired,
+                             options._max_instructions - total_instructions);
+        machine->step(retired);
+        wfi_cycles = replayed._wfi_cycles;
+        instructions_in_loop += retired;
+        total_instructions += retired;
+        virtual_instructions += retired + (options._icount ? wfi_cycles : 0);
+      } else if (!machine->_wfi) {
+        machine->step(num_instructions);
+        retired = num_instructions;
+        instructions_in_loop += num_instructions;
+        total_instructions += num_instructions;
+        virtual_instructions += num_instructions;
+      } else {
+        // need to run step 0 since pending interrupts are handled in step
+        machine->step(0);
+        // work handed over by host threads ends the idle period, the wake fd
+        // stays readable so work posted after this check is not missed
+        bool has_work = !uart_rx.empty() || async_irqs.load() ||
+                        snapshot_requested || profile_report_requested ||
+                        !virtio_input_events.empty();
+        // while recording, staged host input and the virtio backends are
+        // handled on this thread further down the batch
+        if (recording())
+          has_work = has_work || !uart_host_rx.empty() ||
+                     !virtio_input_host_events.empty() ||
+                     virtio_blk_disk._kick.load() ||
+                     virtio_9p_server._kick.load();
+        if (machine->_wfi && !has_work) {
+          uint64_t idle_us = run_stats._idle_us;
+          if (options._icount) {
+            // nothing else advances virtual time, so idle ends at the deadline
+            uint64_t deadline = icount_deadline();
+            if (deadline > virtual_instructions) {
+              wfi_cycles           = deadline - virtual_instructions;
+              virtual_instructions = deadline;
+            } else if (!deadline) {
+              housekeeping_due = idle_until(0);
+            }
+          } else if (timercmp && timercmp > timer) {
+            housekeeping_due = idle_until(timercmp - timer);
+          } else if (!timercmp) {
+            housekeeping_due = idle_until(0);
+          }
+          // the cycles the guest would have run at the current speed
+          if (!options._icount)
+            wfi_cycles = (run_stats._idle_us - idle_us) * ips;
+        }
+      }
+      // timer
+      if (replaying())
+        timer = replayed._timer;
+      else if (options._icount)
+        timer = virtual_instructions / options._icount;
+      else
+        timer = get_time_now_us() - boot_time;
+      if (recording()) record_batch(retired, wfi_cycles);
+      if (timercmp && timer >= timercmp) {
+        if (!(machine->_csr[dawn::MIP] & (1ull << 7)))
+          run_stats._timer_interrupts++;
+        machine->_csr[dawn::MIP] |= (1ull << 7);  // set mtip
+      } else {
+        machine->_csr[dawn::MIP] &= ~(1ull << 7);  // set mtip
+      }
+      perf_update(retired, wfi_cycles);
+      // profile, in mtime so wfi time is sampled as well
+      // a batch or idle period spanning several sample points counts for
+      // all of them, so long batches are not under sampled
+      if (profile_enabled && timer >= profile_next_sample) {
+        uint64_t samples =
+            (timer - profile_next_sample) / profile_interval + 1;
+        profile_sample(machine->_pc, samples);
+        profile_next_sample += samples * profile_interval;
+      }
+      // uart, move host input into the rx fifo
+      if (!uart_rx.empty()) uart_update();
+      if (!virtio_input_events.empty()) virtio_input_flush(virtio_input);
+      if (framebuffer_frame_requested.load(std::memory_order_relaxed))
+        publish_framebuffer_frame();
+      if (recording() || replaying()) run_virtio_backends();
+      // plic, a replay takes the interrupts from the log instead
+      uint32_t irqs = 0;
+      if (replaying()) {
+        async_irqs.store(0, std::memory_order_relaxed);
+        irqs = replay_irqs_after_batch();
+      } else if (async_irqs.load(std::memory_order_relaxed)) {
+        irqs = async_irqs.exchange(0, std::memory_order_acquire);
+        if (recording()) record_irqs(irqs);
+      }
+      for (; irqs; irqs &= irqs - 1)
+        plic_set_pending(std::countr_zero(irqs), true);
+      if (plic._best)
+        machine->_csr[dawn::MIP] |= (1ull << 11);
+      else
+        machine->_csr[dawn::MIP] &= ~(1ull << 11);
+    }
+
+    uint64_t elapsed = get_time_now_us() - loop_start;
+    if (elapsed > 0 && instructions_in_loop > 0) {
+      ips = (ips * 8 + (instructions_in_loop / elapsed) * 2) / 10;
+    }
+
+    if (power_request == power_off)
+      finish_run("guest powered off", power_status);
+    if (power_request == power_reboot) reboot_run();
+    if (interrupt_requested) finish_run("interrupted", 0);
+
+    uint64_t housekeeping_start = get_time_now_us();
+    if (options._timeout_ms &&
+        housekeeping_start - run_start_us >= options._timeout_ms * 1000)
+      finish_run("wall time budget used up", 124);
+    if (!options._bench_path.empty()) bench_poll();
+    if (capture_fd >= 0) capture_poll();
+    if (profile_report_requested.exchange(false) && profile_enabled)
+      write_profile_report();
+    // taken before the interval test, a request must not linger and print a
+    // second line later
+    bool stats_due = stats_requested.exchange(false);
+    if (stats_fd >= 0 && (stats_due || housekeeping_start >= stats_next_us)) {
+      write_stats(housekeeping_start, ips);
+      stats_next_us = housekeeping_start + options._stats_interval_ms * 1000;
+    }
+
+    // between batches the machine is in a consistent state
+    if (snapshot_requested.exchange(false)) {
+      if (options._snapshot_path.empty())
+        std::cerr << "[dem] snapshot requested but no --snapshot=<file>\n";
+      else
+        write_snapshot(options._snapshot_path);
+      // do not count the time spent writing towards guest time
+      boot_time = get_time_now_us() - timer;
+    }
+    run_stats._housekeeping_us += get_time_now_us() - housekeeping_start;
+  }
+
+  return 0;
+}
@@ -0,0 +1,104 @@
+// the parts of dem.cpp that the dem and dem_bench executables reach, both
+// link the same dem_core library. everything else stays internal to dem.cpp
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#include <X11/Xlib.h>
+
+#include "dawn/dawn.hpp"
+
+// single producer single consumer ring, N must be a power of 2
+template <typename T, uint64_t N>
+struct spsc_ring_t {
+  static_assert(std::has_single_bit(N));
+  alignas(64) std::atomic<uint64_t> _head{0};  // next slot to consume
+  alignas(64) std::atomic<uint64_t> _tail{0};  // next slot to produce
+  alignas(64) T _data[N];
+
+  bool empty() const {
+    return _head.load(std::memory_order_acquire) ==
+           _tail.load(std::memory_order_acquire);
+  }
+  bool full() const {
+    return _tail.load(std::memory_order_acquire) -
+               _head.load(std::memory_order_acquire) ==
+           N;
+  }
+  bool push(const T &value) {
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == N) return false;
+    _data[tail % N] = value;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(T &value) {
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) return false;
+    value = _data[head % N];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+  // contiguous readable run starting at the head, for batched consumers
+  const T *peek(uint64_t &count) const {
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    uint64_t tail = _tail.load(std::memory_order_acquire);
+    count         = std::min(tail - head, N - head % N);
+    return &_data[head % N];
+  }
+  void consume(uint64_t count) {
+    _head.store(_head.load(std::memory_order_relaxed) + count,
+                std::memory_order_release);
+  }
+};
+
+struct plic_t {
+  uint32_t _priority[1024];  // 1024 priority of each source
+  uint32_t _pending[32];     // 1024 pending bits
+  uint32_t _enable[32];      // 1024 enable bits per context (only 1 context)
+  uint32_t _threshold;       // minimum priority to trigger an interrupt
+  uint32_t _summary;  // bit n set when _pending[n] & _enable[n] is non zero
+  uint32_t _best;     // best claimable source above threshold, 0 if none
+  // gateway state, level sources stay asserted until the device drops them
+  // and are forwarded again on complete, claimed sources are not forwarded
+  uint32_t _level[32];
+  uint32_t _claimed[32];
+};
+
+extern dawn::machine_t *machine;
+extern const uint64_t   offset;
+extern uint64_t         ram_size;
+
+extern const uint64_t uart_mmio_start;
+extern const uint64_t clint_mmio_start;
+extern const uint64_t plic_mmio_start;
+extern const uint64_t snapshot_mmio_start;
+extern const uint64_t framebuffer_mmio_start;
+extern const uint64_t width;
+extern const uint64_t height;
+extern const uint64_t stride;
+
+extern const dawn::mmio_handler_t uart_handler;
+extern const dawn::mmio_handler_t clint_handler;
+extern const dawn::mmio_handler_t plic_handler;
+extern const dawn::mmio_handler_t snapshot_handler;
+extern const dawn::mmio_handler_t framebuffer_handler;
+extern const dawn::mmio_handler_t mmio_dispatch_handler;
+
+extern spsc_ring_t<uint8_t, 4096>  uart_rx;
+extern spsc_ring_t<uint8_t, 65536> uart_tx;
+extern plic_t                      plic;
+
+void register_mmio_device(const char                 *name,
+                          const dawn::mmio_handler_t &handler);
+void plic_set_pending(uint32_t id, bool pending);
+void convert_framebuffer_rows(XImage *image, uint64_t first_row,
+                              uint64_t num_rows);
+std::vector<uint8_t> generate_dtb();
+
+// parses the command line and runs the guest, the whole of dem's main
+int dem_main(int argc, char **argv);